@@ -5,13 +5,187 @@
 
 #include <QSqlQuery>
 #include <QVariantList>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#if __cplusplus >= 201703L
+#include <charconv>
+#include <string_view>
+#endif
+
 namespace sql_builder {
 
 class Column;
 
+//
+// Process wide table of interned identifiers. Entries are never removed, so
+// an identifier's text keeps its address for the life of the process. Each
+// thread caches the entries it has looked up, and only takes the table's lock
+// for names it has not seen before.
+//
+class IdentifierTable {
+ public:
+  typedef std::pair<uint32_t, const std::string*> Entry;
+
+  static IdentifierTable& instance() {
+    static IdentifierTable table;
+    return table;
+  }
+
+  // id and text of a non-empty name, adding it on first sight
+  Entry intern(const char* data, size_t size) {
+    static thread_local Map cache;
+    auto cached = cache.find(Key{data, size});
+    if (cached != cache.end()) {
+      return cached->second;
+    }
+
+    Entry entry;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto it = _ids.find(Key{data, size});
+      if (it != _ids.end()) {
+        entry = it->second;
+      } else {
+        // 0 is the empty name, which is never looked up
+        uint32_t id = static_cast<uint32_t>(_names.size() + 1);
+        _names.emplace_back(data, size);
+        entry = Entry(id, &_names.back());
+        _ids.emplace(Key{entry.second->data(), size}, entry);
+      }
+    }
+    cache.emplace(Key{entry.second->data(), size}, entry);
+    return entry;
+  }
+
+ private:
+  IdentifierTable() {}
+
+  // looks up borrowed text without building a std::string first
+  struct Key {
+    const char* data;
+    size_t size;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      // fnv-1a
+      uint64_t hash = 14695981039346656037ULL;
+      for (size_t i = 0; i < key.size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(key.data[i])) *
+               1099511628211ULL;
+      }
+      return static_cast<size_t>(hash);
+    }
+  };
+
+  struct KeyEqual {
+    bool operator()(const Key& a, const Key& b) const {
+      return a.size == b.size && std::memcmp(a.data, b.data, a.size) == 0;
+    }
+  };
+
+  typedef std::unordered_map<Key, Entry, KeyHash, KeyEqual> Map;
+
+  std::mutex _mutex;
+  std::deque<std::string> _names;
+  Map _ids;
+};
+
+//
+// Handle to a table or column name. Plain names, optionally qualified, are
+// interned: equal names have equal ids, so they compare as integers, and the
+// text is only copied when a statement is rendered. Anything else, such as
+// "count(*)", "id as uid" or "user u", is an expression and keeps its own
+// copy of the text, so dynamic expressions do not grow the table.
+//
+class Identifier {
+ public:
+  // id shared by all expressions, which compare by text
+  static const uint32_t EXPRESSION = 0xffffffff;
+
+  Identifier() : _id(0), _text(&empty_text()) {}
+  Identifier(const char* name) { set(name, std::strlen(name)); }
+  Identifier(const std::string& name) { set(name.data(), name.size()); }
+#if __cplusplus >= 201703L
+  Identifier(std::string_view name) { set(name.data(), name.size()); }
+#endif
+  Identifier(const Identifier&) = default;
+  Identifier(Identifier&&) = default;
+  Identifier& operator=(const Identifier&) = default;
+  Identifier& operator=(Identifier&&) = default;
+
+  uint32_t id() const { return _id; }
+  const std::string& str() const { return *_text; }
+  bool empty() const { return _id == 0; }
+  bool interned() const { return _id != 0 && _id != EXPRESSION; }
+
+  bool operator==(const Identifier& other) const {
+    return _id == other._id && (_id != EXPRESSION || *_text == *other._text);
+  }
+  bool operator!=(const Identifier& other) const { return !(*this == other); }
+  bool operator<(const Identifier& other) const {
+    if (_id != other._id) {
+      return _id < other._id;
+    }
+    return _id == EXPRESSION && *_text < *other._text;
+  }
+
+ private:
+  static const std::string& empty_text() {
+    static const std::string empty;
+    return empty;
+  }
+
+  // letters, digits, _, $ and * with optional qualifiers
+  static bool plain(const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      char c = data[i];
+      if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || c == '_' || c == '$' || c == '.' ||
+            c == '*')) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void set(const char* data, size_t size) {
+    if (size == 0) {
+      _id = 0;
+      _text = &empty_text();
+    } else if (plain(data, size)) {
+      auto interned = IdentifierTable::instance().intern(data, size);
+      _id = interned.first;
+      _text = interned.second;
+    } else {
+      _id = EXPRESSION;
+      _owned = std::make_shared<const std::string>(data, size);
+      _text = _owned.get();
+    }
+  }
+
+  uint32_t _id;
+  const std::string* _text;
+  std::shared_ptr<const std::string> _owned;
+};
+
+// how a condition or clause uses a column, for index advice
+enum class ColumnUse { EQUALITY, RANGE, JOIN, SORT, GROUP };
+
 template <typename T>
 inline bool is_empty(const T& /* data */) {
   return false;
@@ -43,6 +217,224 @@ inline QVariant to_variant<std::string>(const std::string& data) {
 template <>
 inline QVariant to_variant<Column>(const Column& data);
 
+//
+// literals, used instead of placeholders in inline_literals() mode.
+// append_literal leaves sql untouched and returns false for anything without a
+// safe literal form, and the caller binds the value as usual.
+//
+template <typename T>
+inline bool append_literal(std::string& /* sql */, const T& /* data */) {
+  return false;
+}
+
+template <typename T>
+inline bool append_integer(std::string& sql, T data) {
+#if __cplusplus >= 201703L
+  char buf[24];
+  auto res = std::to_chars(buf, buf + sizeof(buf), data);
+  sql.append(buf, res.ptr);
+#else
+  sql.append(std::to_string(data));
+#endif
+  return true;
+}
+
+inline bool append_literal(std::string& sql, char data) {
+  return append_integer(sql, static_cast<int>(data));
+}
+inline bool append_literal(std::string& sql, signed char data) {
+  return append_integer(sql, static_cast<int>(data));
+}
+inline bool append_literal(std::string& sql, unsigned char data) {
+  return append_integer(sql, static_cast<unsigned>(data));
+}
+inline bool append_literal(std::string& sql, short data) {
+  return append_integer(sql, static_cast<int>(data));
+}
+inline bool append_literal(std::string& sql, unsigned short data) {
+  return append_integer(sql, static_cast<unsigned>(data));
+}
+inline bool append_literal(std::string& sql, int data) {
+  return append_integer(sql, data);
+}
+inline bool append_literal(std::string& sql, unsigned data) {
+  return append_integer(sql, data);
+}
+inline bool append_literal(std::string& sql, long data) {
+  return append_integer(sql, data);
+}
+inline bool append_literal(std::string& sql, unsigned long data) {
+  return append_integer(sql, data);
+}
+inline bool append_literal(std::string& sql, long long data) {
+  return append_integer(sql, data);
+}
+inline bool append_literal(std::string& sql, unsigned long long data) {
+  return append_integer(sql, data);
+}
+
+inline bool append_literal(std::string& sql, double data) {
+  // sql has no literal for inf or nan
+  if (!std::isfinite(data)) {
+    return false;
+  }
+  char buf[32];
+  char* end;
+#if defined(__cpp_lib_to_chars)
+  end = std::to_chars(buf, buf + sizeof(buf), data).ptr;
+#else
+  end = buf + std::snprintf(buf, sizeof(buf), "%.17g", data);
+  // snprintf follows LC_NUMERIC, which may use a decimal comma
+  for (char* p = buf; p < end; ++p) {
+    if (*p == ',') {
+      *p = '.';
+    }
+  }
+#endif
+  bool real = false;
+  for (char* p = buf; p < end; ++p) {
+    if (*p == '.' || *p == 'e') {
+      real = true;
+    } else if ((*p < '0' || *p > '9') && *p != '-' && *p != '+') {
+      return false;
+    }
+  }
+  sql.append(buf, end);
+  // keep whole numbers real rather than letting them become integers
+  if (!real) {
+    sql.append(".0");
+  }
+  return true;
+}
+
+inline bool append_literal(std::string& sql, float data) {
+  return append_literal(sql, static_cast<double>(data));
+}
+
+//
+// Single quoted string literal with embedded quotes doubled. Quotes are
+// located with memchr, which libc vectorizes, and the text between them is
+// copied in bulk. Backslashes (an escape character in mysql's default mode)
+// and nul bytes (which end the statement for C apis) have no portable literal
+// form, so such strings are always bound instead.
+//
+inline bool append_quoted(std::string& sql, const char* data, size_t size) {
+  if (std::memchr(data, '\\', size) || std::memchr(data, '\0', size)) {
+    return false;
+  }
+  const char* end = data + size;
+  sql.reserve(sql.size() + size + 2);
+  sql.push_back('\'');
+  while (auto quote = static_cast<const char*>(
+             std::memchr(data, '\'', end - data))) {
+    sql.append(data, quote + 1);
+    sql.push_back('\'');
+    data = quote + 1;
+  }
+  sql.append(data, end);
+  sql.push_back('\'');
+  return true;
+}
+
+inline bool append_literal(std::string& sql, const char* data) {
+  return append_quoted(sql, data, std::strlen(data));
+}
+
+inline bool append_literal(std::string& sql, const std::string& data) {
+  return append_quoted(sql, data.data(), data.size());
+}
+
+inline bool append_literal(std::string& sql, const QString& data) {
+  QByteArray utf8 = data.toUtf8();
+  return append_quoted(sql, utf8.constData(), utf8.size());
+}
+
+// numbers and strings held in a variant, e.g. values read from a file
+inline bool append_literal(std::string& sql, const QVariant& data) {
+  if (data.isNull()) {
+    return false;
+  }
+  switch (data.userType()) {
+    case QMetaType::Int:
+    case QMetaType::LongLong:
+      return append_integer(sql, data.toLongLong());
+    case QMetaType::UInt:
+    case QMetaType::ULongLong:
+      return append_integer(sql, data.toULongLong());
+    case QMetaType::Float:
+    case QMetaType::Double:
+      return append_literal(sql, data.toDouble());
+    case QMetaType::QString:
+      return append_literal(sql, data.toString());
+  }
+  return false;
+}
+
+//
+// sql with its number and string literals replaced by `?`, so that a
+// statement rendered in inline_literals() mode has the shape it would have
+// had with placeholders. Quoted identifiers are kept.
+//
+inline std::string literal_shape(const std::string& sql) {
+  std::string result;
+  result.reserve(sql.size());
+  size_t size = sql.size();
+  auto digit = [&sql, size](size_t i) {
+    return i < size && std::isdigit(static_cast<unsigned char>(sql[i]));
+  };
+  auto word = [&sql](size_t i) {
+    unsigned char c = sql[i];
+    return std::isalnum(c) || c == '_' || c == '$' || c == '.';
+  };
+  for (size_t i = 0; i < size;) {
+    char c = sql[i];
+    if (c == '"' || c == '`') {
+      size_t close = sql.find(c, i + 1);
+      size_t end = close == std::string::npos ? size : close + 1;
+      result.append(sql, i, end - i);
+      i = end;
+    } else if (c == '\'') {
+      // a doubled quote continues the literal
+      size_t j = i + 1;
+      while (j < size && (sql[j] != '\'' || (j + 1 < size && sql[j + 1] == '\''))) {
+        j += sql[j] == '\'' ? 2 : 1;
+      }
+      result.push_back('?');
+      i = j + 1;
+    } else if (digit(i) && (i == 0 || !word(i - 1))) {
+      // a negative number, where a value is expected
+      size_t last = result.find_last_not_of(' ');
+      if (last != std::string::npos && result[last] == '-' && last > 0) {
+        size_t before = result.find_last_not_of(' ', last - 1);
+        if (before != std::string::npos &&
+            std::strchr("(,=<>", result[before])) {
+          result.resize(last);
+        }
+      }
+      size_t j = i;
+      while (digit(j) || (j < size && sql[j] == '.')) {
+        ++j;
+      }
+      if (j < size && (sql[j] == 'e' || sql[j] == 'E')) {
+        size_t k = j + 1;
+        if (k < size && (sql[k] == '+' || sql[k] == '-')) {
+          ++k;
+        }
+        if (digit(k)) {
+          for (j = k; digit(j); ++j) {
+          }
+        }
+      }
+      result.push_back('?');
+      i = j;
+    } else {
+      result.push_back(c);
+      ++i;
+    }
+  }
+  return result;
+}
+
 template <typename T>
 void join_vector(std::string& result, const std::vector<T>& vec,
                  const char* sep) {
@@ -57,9 +449,58 @@ void join_vector(std::string& result, const std::vector<T>& vec,
   }
 }
 
+inline void join_vector(std::string& result,
+                        const std::vector<Identifier>& vec, const char* sep) {
+  size_t size = vec.size();
+  for (size_t i = 0; i < size; ++i) {
+    if (i < size - 1) {
+      result.append(vec[i].str());
+      result.append(sep);
+    } else {
+      result.append(vec[i].str());
+    }
+  }
+}
+
+//
+// A where, on or having condition as stored by a model: the column it starts
+// with, if any, and the text that follows. The column's name is only copied
+// when the statement is rendered.
+//
+struct Condition {
+  Condition(const std::string& text) : text(text) {}
+  Condition(const char* text) : text(text) {}
+  Condition(const Identifier& name, const std::string& text)
+      : name(name), text(text) {}
+
+  void append_to(std::string& sql) const {
+    sql.append(name.str());
+    sql.append(text);
+  }
+
+  Identifier name;
+  std::string text;
+};
+
+inline void join_vector(std::string& result,
+                        const std::vector<Condition>& vec, const char* sep) {
+  size_t size = vec.size();
+  for (size_t i = 0; i < size; ++i) {
+    vec[i].append_to(result);
+    if (i < size - 1) {
+      result.append(sep);
+    }
+  }
+}
+
 class Column {
  public:
-  Column(const std::string& column) { _cond = column; }
+  Column(const Identifier& column) : _name(column) {}
+  Column(const char* column) : Column(Identifier(column)) {}
+  Column(const std::string& column) : Column(Identifier(column)) {}
+#if __cplusplus >= 201703L
+  Column(std::string_view column) : Column(Identifier(column)) {}
+#endif
   virtual ~Column() {}
 
   Column& as(const std::string& s) {
@@ -70,6 +511,7 @@ class Column {
 
   Column& is_null() {
     _cond.append(" is null");
+    use(ColumnUse::EQUALITY);
     return *this;
   }
 
@@ -78,24 +520,30 @@ class Column {
     return *this;
   }
 
+  // embed values compared against from here on as sql literals
+  Column& inline_literals(bool var) {
+    _inline_literals = var;
+    return *this;
+  }
+
   template <typename T>
   Column& in(const std::vector<T>& args) {
     size_t size = args.size();
     if (size == 1) {
-      _cond.append(" = ?");
-      _bindings.push_back(to_variant(args[0]));
+      _cond.append(" = ");
+      append_value(args[0]);
+      equal(args[0]);
     } else {
       _cond.append(" in (");
       for (size_t i = 0; i < size; ++i) {
+        append_value(args[i]);
         if (i < size - 1) {
-          _cond.append("?, ");
-        } else {
-          _cond.append("?");
+          _cond.append(", ");
         }
-        _bindings.push_back(to_variant(args[i]));
       }
       _cond.append(")");
     }
+    use(ColumnUse::EQUALITY);
     return *this;
   }
 
@@ -103,17 +551,15 @@ class Column {
   Column& not_in(const std::vector<T>& args) {
     size_t size = args.size();
     if (size == 1) {
-      _cond.append(" != ?");
-      _bindings.push_back(to_variant(args[0]));
+      _cond.append(" != ");
+      append_value(args[0]);
     } else {
       _cond.append(" not in (");
       for (size_t i = 0; i < size; ++i) {
+        append_value(args[i]);
         if (i < size - 1) {
-          _cond.append("?, ");
-        } else {
-          _cond.append("?");
+          _cond.append(", ");
         }
-        _bindings.push_back(to_variant(args[i]));
       }
       _cond.append(")");
     }
@@ -122,23 +568,32 @@ class Column {
 
   Column& operator&&(Column& condition) {
     std::string str("(");
-    str.append(_cond);
+    append_to(str);
     str.append(") and (");
-    str.append(condition._cond);
+    condition.append_to(str);
     str.append(")");
     condition._cond = str;
+    condition._whole = true;
     condition._bindings = _bindings + condition._bindings;
+    condition._equalities.insert(condition._equalities.begin(),
+                                 _equalities.begin(), _equalities.end());
+    condition._uses.insert(condition._uses.begin(), _uses.begin(),
+                           _uses.end());
     return condition;
   }
 
   Column& operator||(Column& condition) {
     std::string str("(");
-    str.append(_cond);
+    append_to(str);
     str.append(") or (");
-    str.append(condition._cond);
+    condition.append_to(str);
     str.append(")");
     condition._cond = str;
+    condition._whole = true;
     condition._bindings = _bindings + condition._bindings;
+    // no single index serves either side of an `or` alone
+    condition._equalities.clear();
+    condition._uses.clear();
     return condition;
   }
 
@@ -151,6 +606,8 @@ class Column {
   Column& operator||(const std::string& condition) {
     _cond.append(" or ");
     _cond.append(condition);
+    _equalities.clear();
+    _uses.clear();
     return *this;
   }
 
@@ -163,128 +620,518 @@ class Column {
   Column& operator||(const char* condition) {
     _cond.append(" or ");
     _cond.append(condition);
+    _equalities.clear();
+    _uses.clear();
     return *this;
   }
 
   template <typename T>
   Column& operator==(const T& data) {
-    _cond.append(" = ?");
-    _bindings.push_back(to_variant(data));
+    _cond.append(" = ");
+    append_value(data);
+    equal(data);
+    use(ColumnUse::EQUALITY);
     return *this;
   }
 
   template <>
   Column& operator==(Column const& data) {
     _cond.append(" = ");
-    _cond.append(data.str());
+    data.append_to(_cond);
+    use(ColumnUse::JOIN);
+    _uses.push_back(std::make_pair(data._name, ColumnUse::JOIN));
     return *this;
   }
 
   template <typename T>
   Column& operator!=(const T& data) {
-    _cond.append(" != ?");
-    _bindings.push_back(to_variant(data));
+    _cond.append(" != ");
+    append_value(data);
     return *this;
   }
 
   template <>
   Column& operator!=(Column const& data) {
     _cond.append(" != ");
-    _cond.append(data.str());
+    data.append_to(_cond);
     return *this;
   }
 
   template <typename T>
   Column& operator>=(const T& data) {
-    _cond.append(" >= ?");
-    _bindings.push_back(to_variant(data));
+    _cond.append(" >= ");
+    append_value(data);
+    use(ColumnUse::RANGE);
     return *this;
   }
 
   template <>
   Column& operator>=(Column const& data) {
     _cond.append(" >= ");
-    _cond.append(data.str());
+    data.append_to(_cond);
     return *this;
   }
 
   template <typename T>
   Column& operator<=(const T& data) {
-    _cond.append(" <= ?");
-    _bindings.push_back(to_variant(data));
+    _cond.append(" <= ");
+    append_value(data);
+    use(ColumnUse::RANGE);
     return *this;
   }
 
   template <>
   Column& operator<=(Column const& data) {
     _cond.append(" <= ");
-    _cond.append(data.str());
+    data.append_to(_cond);
     return *this;
   }
 
   template <typename T>
   Column& operator>(const T& data) {
-    _cond.append(" > ?");
-    _bindings.push_back(to_variant(data));
+    _cond.append(" > ");
+    append_value(data);
+    use(ColumnUse::RANGE);
     return *this;
   }
 
   template <>
   Column& operator>(Column const& data) {
     _cond.append(" > ");
-    _cond.append(data.str());
+    data.append_to(_cond);
     return *this;
   }
 
   template <typename T>
   Column& operator<(const T& data) {
-    _cond.append(" < ?");
-    _bindings.push_back(to_variant(data));
+    _cond.append(" < ");
+    append_value(data);
+    use(ColumnUse::RANGE);
     return *this;
   }
 
   template <>
   Column& operator<(Column const& data) {
     _cond.append(" < ");
-    _cond.append(data.str());
+    data.append_to(_cond);
     return *this;
   }
 
-  const std::string& str() const { return _cond; }
+  std::string str() const {
+    std::string str;
+    append_to(str);
+    return str;
+  }
+
+  // the condition as a model stores it, still naming its column by handle
+  Condition condition() const {
+    return _whole ? Condition(_cond) : Condition(_name, _cond);
+  }
+
   QVariantList const& bindings() const { return _bindings; }
 
+  // column = value comparisons that every matching row satisfies, i.e. those
+  // not under an `or`
+  std::vector<std::pair<Identifier, QVariant>> const& equalities() const {
+    return _equalities;
+  }
+
+  // every column compared in a way an index can serve, outside any `or`
+  std::vector<std::pair<Identifier, ColumnUse>> const& uses() const {
+    return _uses;
+  }
+
   operator bool() { return true; }
 
  private:
+  void append_to(std::string& sql) const {
+    if (!_whole) {
+      sql.append(_name.str());
+    }
+    sql.append(_cond);
+  }
+
+  void use(ColumnUse kind) { _uses.push_back(std::make_pair(_name, kind)); }
+
+  template <typename T>
+  void equal(const T& data) {
+    _equalities.push_back(std::make_pair(_name, to_variant(data)));
+  }
+
+  template <typename T>
+  void append_value(const T& data) {
+    if (!_inline_literals || !append_literal(_cond, data)) {
+      _cond.append("?");
+      _bindings.push_back(to_variant(data));
+    }
+  }
+
+  Identifier _name;
+  // what follows _name, or the whole condition once _whole
   std::string _cond;
+  bool _whole = false;
   QVariantList _bindings;
+  std::vector<std::pair<Identifier, QVariant>> _equalities;
+  std::vector<std::pair<Identifier, ColumnUse>> _uses;
+  bool _inline_literals = false;
+};
+
+//
+// The terms of an order by clause, as (expression, descending) pairs.
+//
+inline std::vector<std::pair<std::string, bool>> order_by_terms(
+    const std::string& order_by) {
+  std::vector<std::pair<std::string, bool>> terms;
+  size_t start = 0;
+  while (start < order_by.size()) {
+    size_t end = order_by.find(',', start);
+    if (end == std::string::npos) {
+      end = order_by.size();
+    }
+
+    std::vector<std::string> words;
+    std::string word;
+    for (size_t i = start; i <= end; ++i) {
+      if (i == end || std::isspace(static_cast<unsigned char>(order_by[i]))) {
+        if (!word.empty()) {
+          words.push_back(word);
+          word.clear();
+        }
+      } else {
+        word.push_back(order_by[i]);
+      }
+    }
+    start = end + 1;
+
+    if (words.empty()) {
+      continue;
+    }
+    bool descending = false;
+    if (words.size() > 1) {
+      std::string dir = words.back();
+      for (auto& c : dir) {
+        c = std::tolower(static_cast<unsigned char>(c));
+      }
+      if (dir == "asc" || dir == "desc") {
+        descending = dir == "desc";
+        words.pop_back();
+      }
+    }
+    std::string expression = words.front();
+    for (size_t i = 1; i < words.size(); ++i) {
+      expression.push_back(' ');
+      expression.append(words[i]);
+    }
+    terms.push_back(std::make_pair(expression, descending));
+  }
+  return terms;
+}
+
+//
+// Whether column, as written in a statement on table, is the unqualified
+// column name. A qualifier must name the table or its alias: on "user u",
+// "user.id" and "u.id" are id, while "other.id" is another table's column.
+//
+inline bool same_column(const Identifier& column, const Identifier& name,
+                        const Identifier& table) {
+  if (column == name) {
+    return true;
+  }
+  std::string const& c = column.str();
+  std::string const& n = name.str();
+  if (c.size() <= n.size() || c[c.size() - n.size() - 1] != '.' ||
+      c.compare(c.size() - n.size(), std::string::npos, n) != 0) {
+    return false;
+  }
+  std::string qualifier = c.substr(0, c.size() - n.size() - 1);
+
+  // the first word of table is its name and the last its alias
+  std::string const& t = table.str();
+  size_t first = t.find_first_of(" \t\n");
+  size_t last = t.find_last_of(" \t\n");
+  if (first == std::string::npos) {
+    return qualifier == t;
+  }
+  return t.compare(0, first, qualifier) == 0 ||
+         t.compare(last + 1, std::string::npos, qualifier) == 0;
+}
+
+inline bool find_equality(
+    const std::vector<std::pair<Identifier, QVariant>>& equalities,
+    const Identifier& column, const Identifier& table, QVariant& value) {
+  for (auto const& it : equalities) {
+    if (same_column(it.first, column, table)) {
+      value = it.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// The aggregate call a select column starts with, such as "max(age)",
+// "count(*) as n" or "sum(price) * 2". min and max with more than one
+// argument are the scalar functions and not aggregates.
+//
+struct AggregateCall {
+  // lower case, e.g. "count"
+  std::string function;
+  // e.g. count(distinct id)
+  bool distinct = false;
+  // the column is the call alone, optionally aliased, not an expression
+  // over it
+  bool whole = false;
+};
+
+inline bool aggregate_call(const Identifier& column, AggregateCall& call) {
+  static const char* const functions[] = {
+      "count", "sum", "total", "avg", "min", "max", "group_concat",
+      "string_agg", "array_agg", "json_group_array", "json_group_object",
+      "bool_and", "bool_or", "every", "stddev", "variance"};
+  const std::string& text = column.str();
+  auto at = [&text](size_t i) {
+    return i < text.size() ? static_cast<unsigned char>(text[i]) : 0;
+  };
+  size_t i = 0;
+  while (std::isspace(at(i))) {
+    ++i;
+  }
+  std::string name;
+  while (std::isalnum(at(i)) || at(i) == '_') {
+    name.push_back(std::tolower(at(i++)));
+  }
+  while (std::isspace(at(i))) {
+    ++i;
+  }
+  if (at(i) != '(' ||
+      std::none_of(functions, functions + sizeof(functions) / sizeof(*functions),
+                   [&name](const char* f) { return name == f; })) {
+    return false;
+  }
+
+  size_t open = ++i;
+  int depth = 1;
+  int arguments = 1;
+  for (; i < text.size() && depth > 0; ++i) {
+    char c = text[i];
+    if (c == '\'' || c == '"') {
+      // skip quoted text, which may hold parentheses and commas
+      size_t close = text.find(c, i + 1);
+      i = close == std::string::npos ? text.size() - 1 : close;
+    } else if (c == '(') {
+      ++depth;
+    } else if (c == ')') {
+      --depth;
+    } else if (c == ',' && depth == 1) {
+      ++arguments;
+    }
+  }
+  if (depth > 0 || ((name == "min" || name == "max") && arguments > 1)) {
+    return false;
+  }
+
+  call.function = name;
+  while (std::isspace(at(open))) {
+    ++open;
+  }
+  std::string head;
+  for (size_t j = open; j < open + 8; ++j) {
+    head.push_back(std::tolower(at(j)));
+  }
+  call.distinct = head == "distinct" &&
+                  !(std::isalnum(at(open + 8)) || at(open + 8) == '_');
+  // anything after the call but an alias makes it an expression
+  call.whole = true;
+  for (; i < text.size(); ++i) {
+    unsigned char c = at(i);
+    if (!std::isalnum(c) && !std::isspace(c) && c != '_' && c != '"' &&
+        c != '`') {
+      call.whole = false;
+    }
+  }
+  return true;
+}
+
+inline bool is_aggregate(const Identifier& column) {
+  AggregateCall call;
+  return aggregate_call(column, call);
+}
+
+class SqlModel;
+class ShardedExecutor;
+class IndexAdvisor;
+
+//
+// Watches model executions once registered with add_observer(). Observers
+// are called from whichever thread ran the model, after the statement ran and
+// while the query still holds its result. No lock is held during the call, so
+// an observer may run models and add or remove observers, but it must be safe
+// to call from several threads at once.
+//
+class QueryObserver {
+ public:
+  virtual ~QueryObserver() {}
+  virtual void executed(SqlModel& model, QSqlQuery& query, bool ok,
+                        double elapsed_ms) = 0;
+};
+
+//
+// The registered observers, as an immutable list that is replaced on every
+// change. Executions call the list they found when they started.
+//
+struct ObserverList {
+  typedef std::vector<QueryObserver*> Observers;
+
+  std::mutex mutex;
+  std::shared_ptr<const Observers> list{std::make_shared<Observers>()};
+  // replaced lists that executions may still be calling
+  std::vector<std::weak_ptr<const Observers>> retired;
+  std::atomic<bool> active{false};
+
+  // with mutex held
+  void replace(const std::shared_ptr<const Observers>& next) {
+    retired.erase(std::remove_if(retired.begin(), retired.end(),
+                                 [](const std::weak_ptr<const Observers>& it) {
+                                   return it.expired();
+                                 }),
+                  retired.end());
+    retired.push_back(list);
+    list = next;
+    active = !next->empty();
+  }
 };
 
+inline ObserverList& observer_list() {
+  static ObserverList observers;
+  return observers;
+}
+
+// lists the current thread is calling, innermost last
+inline std::vector<const ObserverList::Observers*>& observers_in_use() {
+  static thread_local std::vector<const ObserverList::Observers*> in_use;
+  return in_use;
+}
+
+inline void add_observer(QueryObserver* observer) {
+  auto& observers = observer_list();
+  std::lock_guard<std::mutex> lock(observers.mutex);
+  auto next = std::make_shared<ObserverList::Observers>(*observers.list);
+  next->push_back(observer);
+  observers.replace(next);
+}
+
+//
+// Once this returns the observer is no longer called and may be destroyed.
+// Called from the observer itself, only its current call may still be running.
+//
+inline void remove_observer(QueryObserver* observer) {
+  auto& observers = observer_list();
+  std::vector<std::weak_ptr<const ObserverList::Observers>> calling;
+  {
+    std::lock_guard<std::mutex> lock(observers.mutex);
+    auto next = std::make_shared<ObserverList::Observers>(*observers.list);
+    next->erase(std::remove(next->begin(), next->end(), observer), next->end());
+    observers.replace(next);
+    for (auto const& it : observers.retired) {
+      auto list = it.lock();
+      if (list &&
+          std::find(list->begin(), list->end(), observer) != list->end()) {
+        calling.push_back(it);
+      }
+    }
+  }
+
+  // wait for executions still calling an old list, except those further up
+  // this thread's stack
+  auto const& in_use = observers_in_use();
+  for (auto const& it : calling) {
+    auto list = it.lock().get();
+    long own = std::count(in_use.begin(), in_use.end(), list);
+    while (it.use_count() > own) {
+      std::this_thread::yield();
+    }
+  }
+}
+
 class SqlModel {
  public:
   SqlModel() {}
+  SqlModel(SqlModel&& m) = default;
   virtual ~SqlModel() {}
 
   virtual const std::string& str() = 0;
   virtual bool exec(QSqlQuery& query) = 0;
+  // all bound values, in the order their placeholders appear in str()
+  virtual QVariantList bindings() const = 0;
+  // true, with its value, when every row the statement touches has column
+  // equal to a single value; column is unqualified and matches the first
+  // table's columns
+  virtual bool equality(const Identifier& column, QVariant& value) const = 0;
   const std::string& last_sql() { return _sql; }
 
+  // execute on a query already prepared with this model's str(), such as one
+  // from StatementRegistry::query(), binding the values without preparing
+  // the statement again; a query prepared with any other statement is
+  // prepared again, so values are never bound into the wrong one
+  bool exec_prepared(QSqlQuery& query) {
+    auto const& sql = str();
+    if (query.lastQuery() != QString::fromStdString(sql) &&
+        !query.prepare(sql.c_str())) {
+      return false;
+    }
+    for (auto const& it : bindings()) {
+      query.addBindValue(it);
+    }
+    return run(query);
+  }
+
  private:
   SqlModel(const SqlModel& m) = delete;
   SqlModel& operator=(const SqlModel& data) = delete;
 
  protected:
+  // execute the prepared and bound query, timing it for any observers
+  bool run(QSqlQuery& query) {
+    auto& observers = observer_list();
+    if (!observers.active) {
+      return query.exec();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = query.exec();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::shared_ptr<const ObserverList::Observers> list;
+    {
+      std::lock_guard<std::mutex> lock(observers.mutex);
+      list = observers.list;
+    }
+    // marks the list as called from this thread, see remove_observer()
+    struct InUse {
+      explicit InUse(const ObserverList::Observers* list) {
+        observers_in_use().push_back(list);
+      }
+      ~InUse() { observers_in_use().pop_back(); }
+    } in_use(list.get());
+    for (auto observer : *list) {
+      observer->executed(*this, query, ok, elapsed.count());
+    }
+    return ok;
+  }
+
   std::string _sql;
 };
 
 class SelectModel : public SqlModel {
  public:
-  SelectModel() : _distinct(false) {}
+  SelectModel() : _distinct(false), _join_type(nullptr) {}
+  SelectModel(SelectModel&& m) = default;
   virtual ~SelectModel() {}
 
   template <typename... Args>
-  SelectModel& select(const std::string& str, Args&&... columns) {
-    _select_columns.push_back(str);
+  SelectModel& select(const Identifier& column, Args&&... columns) {
+    _select_columns.push_back(column);
     select(columns...);
     return *this;
   }
@@ -298,13 +1145,8 @@ class SelectModel : public SqlModel {
   }
 
   template <typename... Args>
-  SelectModel& from(const std::string& table_name, Args&&... tables) {
-    if (_table_name.empty()) {
-      _table_name = table_name;
-    } else {
-      _table_name.append(", ");
-      _table_name.append(table_name);
-    }
+  SelectModel& from(const Identifier& table_name, Args&&... tables) {
+    _tables.push_back(table_name);
     from(tables...);
     return *this;
   }
@@ -312,43 +1154,43 @@ class SelectModel : public SqlModel {
   // for recursion
   SelectModel& from() { return *this; }
 
-  SelectModel& join(const std::string& table_name) {
+  SelectModel& join(const Identifier& table_name) {
     _join_type = "join";
     _join_table = table_name;
     return *this;
   }
 
-  SelectModel& left_join(const std::string& table_name) {
+  SelectModel& left_join(const Identifier& table_name) {
     _join_type = "left join";
     _join_table = table_name;
     return *this;
   }
 
-  SelectModel& left_outer_join(const std::string& table_name) {
+  SelectModel& left_outer_join(const Identifier& table_name) {
     _join_type = "left outer join";
     _join_table = table_name;
     return *this;
   }
 
-  SelectModel& right_join(const std::string& table_name) {
+  SelectModel& right_join(const Identifier& table_name) {
     _join_type = "right join";
     _join_table = table_name;
     return *this;
   }
 
-  SelectModel& right_outer_join(const std::string& table_name) {
+  SelectModel& right_outer_join(const Identifier& table_name) {
     _join_type = "right outer join";
     _join_table = table_name;
     return *this;
   }
 
-  SelectModel& full_join(const std::string& table_name) {
+  SelectModel& full_join(const Identifier& table_name) {
     _join_type = "full join";
     _join_table = table_name;
     return *this;
   }
 
-  SelectModel& full_outer_join(const std::string& table_name) {
+  SelectModel& full_outer_join(const Identifier& table_name) {
     _join_type = "full outer join";
     _join_table = table_name;
     return *this;
@@ -359,9 +1201,18 @@ class SelectModel : public SqlModel {
     return *this;
   }
 
+  // raw sql; a string literal would otherwise convert to a Column as
+  // readily as to a std::string
+  SelectModel& on(const char* condition) {
+    _join_on_condition.push_back(condition);
+    return *this;
+  }
+
   SelectModel& on(const Column& condition) {
-    _join_on_condition.push_back(condition.str());
+    _join_on_condition.push_back(condition.condition());
     _join_on_bindings.append(condition.bindings());
+    _column_uses.insert(_column_uses.end(), condition.uses().begin(),
+                        condition.uses().end());
     return *this;
   }
 
@@ -370,15 +1221,25 @@ class SelectModel : public SqlModel {
     return *this;
   }
 
+  SelectModel& where(const char* condition) {
+    _where_condition.push_back(condition);
+    return *this;
+  }
+
   SelectModel& where(const Column& condition) {
-    _where_condition.push_back(condition.str());
+    _where_condition.push_back(condition.condition());
     _where_bindings.append(condition.bindings());
+    _where_equalities.insert(_where_equalities.end(),
+                             condition.equalities().begin(),
+                             condition.equalities().end());
+    _column_uses.insert(_column_uses.end(), condition.uses().begin(),
+                        condition.uses().end());
     return *this;
   }
 
   template <typename... Args>
-  SelectModel& group_by(const std::string& str, Args&&... columns) {
-    _groupby_columns.push_back(str);
+  SelectModel& group_by(const Identifier& column, Args&&... columns) {
+    _groupby_columns.push_back(column);
     group_by(columns...);
     return *this;
   }
@@ -391,8 +1252,13 @@ class SelectModel : public SqlModel {
     return *this;
   }
 
+  SelectModel& having(const char* condition) {
+    _having_condition.push_back(condition);
+    return *this;
+  }
+
   SelectModel& having(const Column& condition) {
-    _having_condition.push_back(condition.str());
+    _having_condition.push_back(condition.condition());
     _having_bindings.append(condition.bindings());
     return *this;
   }
@@ -429,12 +1295,18 @@ class SelectModel : public SqlModel {
     }
     join_vector(_sql, _select_columns, ", ");
     _sql.append(" from ");
-    _sql.append(_table_name);
-    if (!_join_type.empty()) {
+    if (!_from_subquery.empty()) {
+      _sql.append("(");
+      _sql.append(_from_subquery);
+      _sql.append(") as counted");
+    } else {
+      join_vector(_sql, _tables, ", ");
+    }
+    if (_join_type) {
       _sql.append(" ");
       _sql.append(_join_type);
       _sql.append(" ");
-      _sql.append(_join_table);
+      _sql.append(_join_table.str());
     }
     if (!_join_on_condition.empty()) {
       _sql.append(" on ");
@@ -474,6 +1346,10 @@ class SelectModel : public SqlModel {
       return false;
     }
 
+    for (auto const& it : _from_bindings) {
+      query.addBindValue(it);
+    }
+
     for (auto const& it : _join_on_bindings) {
       query.addBindValue(it);
     }
@@ -486,20 +1362,82 @@ class SelectModel : public SqlModel {
       query.addBindValue(it);
     }
 
-    return query.exec();
+    return run(query);
+  }
+
+  QVariantList bindings() const override {
+    return _from_bindings + _join_on_bindings + _where_bindings +
+           _having_bindings;
+  }
+
+  bool equality(const Identifier& column, QVariant& value) const override {
+    return find_equality(_where_equalities, column,
+                         _tables.empty() ? Identifier() : _tables.front(),
+                         value);
+  }
+
+  //
+  // A query for the number of rows this one returns, without its order by,
+  // limit and offset. Distinct, grouped and aggregate queries are counted
+  // through a derived table.
+  //
+  SelectModel count() const {
+    SelectModel result;
+    result._select_columns.push_back("count(*)");
+    if (!derived()) {
+      copy_filter(result);
+      return result;
+    }
+
+    SelectModel rows;
+    copy_filter(rows);
+    rows._select_columns = _select_columns;
+    rows._distinct = _distinct;
+    rows.wrap(result);
+    return result;
+  }
+
+  //
+  // A query returning at most one row when this one returns any, as
+  // `select 1 ... limit 1`. Aggregates without a group by always return a
+  // row, so those are tested through a derived table. Grouped queries with a
+  // having clause keep their columns, which the having clause may refer to.
+  //
+  SelectModel exists() const {
+    SelectModel result;
+    if (_groupby_columns.empty() && has_aggregate()) {
+      SelectModel rows;
+      copy_filter(rows);
+      rows._select_columns = _select_columns;
+      rows.wrap(result);
+      result._select_columns.push_back("1");
+    } else {
+      copy_filter(result);
+      if (_groupby_columns.empty() || _having_condition.empty()) {
+        result._select_columns.push_back("1");
+      } else {
+        result._select_columns = _select_columns;
+      }
+    }
+    result._limit = "1";
+    return result;
   }
 
   SelectModel& reset() {
     _select_columns.clear();
     _distinct = false;
     _groupby_columns.clear();
-    _table_name.clear();
-    _join_type.clear();
-    _join_table.clear();
+    _from_subquery.clear();
+    _from_bindings.clear();
+    _tables.clear();
+    _join_type = nullptr;
+    _join_table = Identifier();
     _join_on_condition.clear();
     _join_on_bindings.clear();
     _where_condition.clear();
     _where_bindings.clear();
+    _where_equalities.clear();
+    _column_uses.clear();
     _having_condition.clear();
     _having_bindings.clear();
     _order_by.clear();
@@ -512,18 +1450,70 @@ class SelectModel : public SqlModel {
     return out;
   }
 
+  // rewrites limit and offset for each shard
+  friend class ShardedExecutor;
+  // reads the clauses
+  friend class IndexAdvisor;
+
  protected:
-  std::vector<std::string> _select_columns;
+  bool has_aggregate() const {
+    return std::any_of(_select_columns.begin(), _select_columns.end(),
+                       [](const Identifier& it) { return is_aggregate(it); });
+  }
+
+  // whether the rows cannot be counted by replacing the select columns
+  bool derived() const {
+    return _distinct || !_groupby_columns.empty() || has_aggregate();
+  }
+
+  // turns to into a query over this one's rows. The derived table keeps
+  // this one's tables and equalities, so that it is routed and advised on
+  // like the query it wraps.
+  void wrap(SelectModel& to) {
+    to._from_subquery = str();
+    to._from_bindings = bindings();
+    to._tables = _tables;
+    to._where_equalities = _where_equalities;
+    to._column_uses = _column_uses;
+  }
+
+  // everything that decides which rows match: tables, join, where, group by
+  // and having, with their bindings
+  void copy_filter(SelectModel& to) const {
+    to._tables = _tables;
+    to._from_subquery = _from_subquery;
+    to._from_bindings = _from_bindings;
+    to._join_type = _join_type;
+    to._join_table = _join_table;
+    to._join_on_condition = _join_on_condition;
+    to._join_on_bindings = _join_on_bindings;
+    to._where_condition = _where_condition;
+    to._where_bindings = _where_bindings;
+    to._where_equalities = _where_equalities;
+    to._column_uses = _column_uses;
+    to._groupby_columns = _groupby_columns;
+    to._having_condition = _having_condition;
+    to._having_bindings = _having_bindings;
+  }
+
+  std::vector<Identifier> _select_columns;
   bool _distinct;
-  std::vector<std::string> _groupby_columns;
-  std::string _table_name;
-  std::string _join_type;
-  std::string _join_table;
-  std::vector<std::string> _join_on_condition;
+  std::vector<Identifier> _groupby_columns;
+  std::vector<Identifier> _tables;
+  // a derived table used instead of _tables in str(), see count(); _tables
+  // then names the tables it reads
+  std::string _from_subquery;
+  QVariantList _from_bindings;
+  const char* _join_type;
+  Identifier _join_table;
+  std::vector<Condition> _join_on_condition;
   QVariantList _join_on_bindings;
-  std::vector<std::string> _where_condition;
+  std::vector<Condition> _where_condition;
   QVariantList _where_bindings;
-  std::vector<std::string> _having_condition;
+  std::vector<std::pair<Identifier, QVariant>> _where_equalities;
+  // columns used by where and join conditions, for index advice
+  std::vector<std::pair<Identifier, ColumnUse>> _column_uses;
+  std::vector<Condition> _having_condition;
   QVariantList _having_bindings;
   std::string _order_by;
   std::string _limit;
@@ -536,19 +1526,25 @@ class InsertModel : public SqlModel {
   virtual ~InsertModel() {}
 
   template <typename T>
-  InsertModel& insert(const std::string& c, const T& data) {
+  InsertModel& insert(const Identifier& c, const T& data) {
     _columns.push_back(c);
-    _values.push_back("?");
-    _value_bindings.push_back(to_variant(data));
+    _row.push_back(to_variant(data));
+    std::string literal;
+    if (_inline_literals && append_literal(literal, data)) {
+      _values.push_back(literal);
+    } else {
+      _values.push_back("?");
+      _value_bindings.push_back(to_variant(data));
+    }
     return *this;
   }
 
   template <typename T>
-  InsertModel& operator()(const std::string& c, const T& data) {
+  InsertModel& operator()(const Identifier& c, const T& data) {
     return insert(c, data);
   }
 
-  InsertModel& into(const std::string& table_name) {
+  InsertModel& into(const Identifier& table_name) {
     _table_name = table_name;
     return *this;
   }
@@ -558,6 +1554,12 @@ class InsertModel : public SqlModel {
     return *this;
   }
 
+  // embed values inserted from here on as sql literals
+  InsertModel& inline_literals(bool var) {
+    _inline_literals = var;
+    return *this;
+  }
+
   virtual const std::string& str() override {
     _sql.clear();
     std::string v_ss;
@@ -568,18 +1570,18 @@ class InsertModel : public SqlModel {
       _sql.append("insert into ");
     }
 
-    _sql.append(_table_name);
+    _sql.append(_table_name.str());
     _sql.append("(");
     v_ss.append(" values(");
     size_t size = _columns.size();
     for (size_t i = 0; i < size; ++i) {
       if (i < size - 1) {
-        _sql.append(_columns[i]);
+        _sql.append(_columns[i].str());
         _sql.append(", ");
         v_ss.append(_values[i]);
         v_ss.append(", ");
       } else {
-        _sql.append(_columns[i]);
+        _sql.append(_columns[i].str());
         _sql.append(")");
         v_ss.append(_values[i]);
         v_ss.append(")");
@@ -600,12 +1602,25 @@ class InsertModel : public SqlModel {
       query.addBindValue(it);
     }
 
-    return query.exec();
+    return run(query);
+  }
+
+  QVariantList bindings() const override { return _value_bindings; }
+
+  bool equality(const Identifier& column, QVariant& value) const override {
+    for (size_t i = 0; i < _columns.size(); ++i) {
+      if (same_column(_columns[i], column, _table_name)) {
+        value = _row[i];
+        return true;
+      }
+    }
+    return false;
   }
 
   InsertModel& reset() {
-    _table_name.clear();
+    _table_name = Identifier();
     _columns.clear();
+    _row.clear();
     _values.clear();
     _value_bindings.clear();
     return *this;
@@ -618,16 +1633,20 @@ class InsertModel : public SqlModel {
 
  protected:
   bool _replace = false;
-  std::string _table_name;
-  std::vector<std::string> _columns;
+  bool _inline_literals = false;
+  Identifier _table_name;
+  std::vector<Identifier> _columns;
+  // every inserted value, bound or not, for equality()
+  QVariantList _row;
   std::vector<std::string> _values;
   QVariantList _value_bindings;
 };
 
 template <>
-inline InsertModel& InsertModel::insert(const std::string& c,
+inline InsertModel& InsertModel::insert(const Identifier& c,
                                         const std::nullptr_t&) {
   _columns.push_back(c);
+  _row.push_back(QVariant());
   _values.push_back("null");
   return *this;
 }
@@ -637,27 +1656,37 @@ class UpdateModel : public SqlModel {
   UpdateModel() {}
   virtual ~UpdateModel() {}
 
-  UpdateModel& update(const std::string& table_name) {
+  UpdateModel& update(const Identifier& table_name) {
     _table_name = table_name;
     return *this;
   }
 
+  // embed values set from here on as sql literals
+  UpdateModel& inline_literals(bool var) {
+    _inline_literals = var;
+    return *this;
+  }
+
   template <typename T>
-  UpdateModel& set(const std::string& c, const T& data,
+  UpdateModel& set(const Identifier& c, const T& data,
                    bool ignoreIfEmpty = false) {
     if (ignoreIfEmpty && is_empty(data)) {
       return *this;
     }
 
-    std::string str(c);
-    str.append(" = ?");
-    _set_columns.push_back(str);
-    _set_bindings.push_back(to_variant(data));
+    std::string literal;
+    if (_inline_literals && append_literal(literal, data)) {
+      _set_values.push_back(literal);
+    } else {
+      _set_values.push_back("?");
+      _set_bindings.push_back(to_variant(data));
+    }
+    _set_columns.push_back(c);
     return *this;
   }
 
   template <typename T>
-  UpdateModel& operator()(const std::string& c, const T& data) {
+  UpdateModel& operator()(const Identifier& c, const T& data) {
     return set(c, data);
   }
 
@@ -666,18 +1695,36 @@ class UpdateModel : public SqlModel {
     return *this;
   }
 
+  UpdateModel& where(const char* condition) {
+    _where_condition.push_back(condition);
+    return *this;
+  }
+
   UpdateModel& where(const Column& condition) {
-    _where_condition.push_back(condition.str());
+    _where_condition.push_back(condition.condition());
     _where_bindings.append(condition.bindings());
+    _where_equalities.insert(_where_equalities.end(),
+                             condition.equalities().begin(),
+                             condition.equalities().end());
+    _column_uses.insert(_column_uses.end(), condition.uses().begin(),
+                        condition.uses().end());
     return *this;
   }
 
   virtual const std::string& str() override {
     _sql.clear();
     _sql.append("update ");
-    _sql.append(_table_name);
+    _sql.append(_table_name.str());
     _sql.append(" set ");
-    join_vector(_sql, _set_columns, ", ");
+    size_t columns = _set_columns.size();
+    for (size_t i = 0; i < columns; ++i) {
+      if (i > 0) {
+        _sql.append(", ");
+      }
+      _sql.append(_set_columns[i].str());
+      _sql.append(" = ");
+      _sql.append(_set_values[i]);
+    }
     size_t size = _where_condition.size();
     if (size > 0) {
       _sql.append(" where ");
@@ -701,15 +1748,36 @@ class UpdateModel : public SqlModel {
       query.addBindValue(it);
     }
 
-    return query.exec();
+    return run(query);
+  }
+
+  QVariantList bindings() const override {
+    return _set_bindings + _where_bindings;
+  }
+
+  bool equality(const Identifier& column, QVariant& value) const override {
+    return find_equality(_where_equalities, column, _table_name, value);
+  }
+
+  // whether the statement sets column
+  bool sets(const Identifier& column) const {
+    for (auto const& it : _set_columns) {
+      if (same_column(it, column, _table_name)) {
+        return true;
+      }
+    }
+    return false;
   }
 
   UpdateModel& reset() {
-    _table_name.clear();
+    _table_name = Identifier();
     _set_columns.clear();
+    _set_values.clear();
     _set_bindings.clear();
     _where_condition.clear();
     _where_bindings.clear();
+    _where_equalities.clear();
+    _column_uses.clear();
     return *this;
   }
   friend inline std::ostream& operator<<(std::ostream& out, UpdateModel& mod) {
@@ -717,20 +1785,27 @@ class UpdateModel : public SqlModel {
     return out;
   }
 
+  // reads the clauses
+  friend class IndexAdvisor;
+
  protected:
-  std::vector<std::string> _set_columns;
+  std::vector<Identifier> _set_columns;
+  std::vector<std::string> _set_values;
   QVariantList _set_bindings;
-  std::string _table_name;
-  std::vector<std::string> _where_condition;
+  bool _inline_literals = false;
+  Identifier _table_name;
+  std::vector<Condition> _where_condition;
   QVariantList _where_bindings;
+  std::vector<std::pair<Identifier, QVariant>> _where_equalities;
+  // columns used by where and join conditions, for index advice
+  std::vector<std::pair<Identifier, ColumnUse>> _column_uses;
 };
 
 template <>
-inline UpdateModel& UpdateModel::set(const std::string& c,
+inline UpdateModel& UpdateModel::set(const Identifier& c,
                                      const std::nullptr_t&, bool) {
-  std::string str(c);
-  str.append(" = null");
-  _set_columns.push_back(str);
+  _set_columns.push_back(c);
+  _set_values.push_back("null");
   return *this;
 }
 
@@ -742,13 +1817,8 @@ class DeleteModel : public SqlModel {
   DeleteModel& _delete() { return *this; }
 
   template <typename... Args>
-  DeleteModel& from(const std::string& table_name, Args&&... tables) {
-    if (_table_name.empty()) {
-      _table_name = table_name;
-    } else {
-      _table_name.append(", ");
-      _table_name.append(table_name);
-    }
+  DeleteModel& from(const Identifier& table_name, Args&&... tables) {
+    _tables.push_back(table_name);
     from(tables...);
     return *this;
   }
@@ -761,16 +1831,26 @@ class DeleteModel : public SqlModel {
     return *this;
   }
 
+  DeleteModel& where(const char* condition) {
+    _where_condition.push_back(condition);
+    return *this;
+  }
+
   DeleteModel& where(const Column& condition) {
-    _where_condition.push_back(condition.str());
+    _where_condition.push_back(condition.condition());
     _where_bindings.append(condition.bindings());
+    _where_equalities.insert(_where_equalities.end(),
+                             condition.equalities().begin(),
+                             condition.equalities().end());
+    _column_uses.insert(_column_uses.end(), condition.uses().begin(),
+                        condition.uses().end());
     return *this;
   }
 
   virtual const std::string& str() override {
     _sql.clear();
     _sql.append("delete from ");
-    _sql.append(_table_name);
+    join_vector(_sql, _tables, ", ");
     size_t size = _where_condition.size();
     if (size > 0) {
       _sql.append(" where ");
@@ -790,13 +1870,23 @@ class DeleteModel : public SqlModel {
       query.addBindValue(it);
     }
 
-    return query.exec();
+    return run(query);
+  }
+
+  QVariantList bindings() const override { return _where_bindings; }
+
+  bool equality(const Identifier& column, QVariant& value) const override {
+    return find_equality(_where_equalities, column,
+                         _tables.empty() ? Identifier() : _tables.front(),
+                         value);
   }
 
   DeleteModel& reset() {
-    _table_name.clear();
+    _tables.clear();
     _where_condition.clear();
     _where_bindings.clear();
+    _where_equalities.clear();
+    _column_uses.clear();
     return *this;
   }
   friend inline std::ostream& operator<<(std::ostream& out, DeleteModel& mod) {
@@ -804,10 +1894,16 @@ class DeleteModel : public SqlModel {
     return out;
   }
 
+  // reads the clauses
+  friend class IndexAdvisor;
+
  protected:
-  std::string _table_name;
-  std::vector<std::string> _where_condition;
+  std::vector<Identifier> _tables;
+  std::vector<Condition> _where_condition;
   QVariantList _where_bindings;
+  std::vector<std::pair<Identifier, QVariant>> _where_equalities;
+  // columns used by where and join conditions, for index advice
+  std::vector<std::pair<Identifier, ColumnUse>> _column_uses;
 };
 
 }  // namespace sql_builder
\ No newline at end of file
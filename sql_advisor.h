@@ -0,0 +1,443 @@
+/**
+ * Index suggestions built from the predicates of the models actually
+ * executed, weighted by how often they run and how long they take.
+ */
+#pragma once
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "sql.h"
+
+namespace sql_builder {
+
+//
+// How often a column took part in each kind of clause, counted once per
+// execution of a statement using it.
+//
+struct ColumnUsage {
+  std::string table;
+  std::string column;
+  unsigned long long equality = 0;
+  unsigned long long range = 0;
+  unsigned long long join = 0;
+  unsigned long long sort = 0;
+  unsigned long long group = 0;
+  // total time of the executions that used the column
+  double total_ms = 0;
+};
+
+struct IndexSuggestion {
+  std::string table;
+  std::vector<std::string> columns;
+  // executions and time of the statements the index would serve
+  unsigned long long executions = 0;
+  double total_ms = 0;
+
+  std::string sql() const {
+    std::string name("idx_" + table);
+    std::string list;
+    for (auto const& it : columns) {
+      name.append("_" + it);
+      if (!list.empty()) {
+        list.append(", ");
+      }
+      list.append(it);
+    }
+    return "create index " + name + " on " + table + "(" + list + ")";
+  }
+};
+
+//
+// A QueryObserver recording, per table, the columns models filter, join,
+// sort and group on:
+//
+//   IndexAdvisor advisor;
+//   add_observer(&advisor);
+//   ...
+//   for (auto const& it : advisor.suggest(db)) {
+//     std::cout << it.sql() << std::endl;
+//   }
+//
+// Each statement shape proposes one composite index per table: its equality
+// and join columns, followed by its first range column, or when it has no
+// range, by its group by or else order by columns. Columns qualified with a
+// table name or alias are attributed to that table, unqualified ones to the
+// first table in the from clause. Conditions under an `or` are left out.
+// Shapes are told apart as by QueryStats, with literals as placeholders.
+//
+class IndexAdvisor : public QueryObserver {
+ public:
+  IndexAdvisor() {}
+  virtual ~IndexAdvisor() {}
+
+  void executed(SqlModel& model, QSqlQuery& /* query */, bool ok,
+                double elapsed_ms) override {
+    if (!ok) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto inserted = _shapes.emplace(literal_shape(model.last_sql()), Shape());
+    Shape& shape = inserted.first->second;
+    if (inserted.second) {
+      analyze(model, shape);
+    }
+    ++shape.executions;
+    shape.total_ms += elapsed_ms;
+
+    for (auto const& it : shape.uses) {
+      ColumnUsage& usage = _usage[std::make_pair(it.table, it.column)];
+      usage.table = it.table;
+      usage.column = it.column;
+      switch (it.kind) {
+        case ColumnUse::EQUALITY:
+          ++usage.equality;
+          break;
+        case ColumnUse::RANGE:
+          ++usage.range;
+          break;
+        case ColumnUse::JOIN:
+          ++usage.join;
+          break;
+        case ColumnUse::SORT:
+          ++usage.sort;
+          break;
+        case ColumnUse::GROUP:
+          ++usage.group;
+          break;
+      }
+      usage.total_ms += elapsed_ms;
+    }
+  }
+
+  std::vector<ColumnUsage> usage() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<ColumnUsage> result;
+    for (auto const& it : _usage) {
+      result.push_back(it.second);
+    }
+    return result;
+  }
+
+  //
+  // Suggested indexes, most total time first. Suggestions already served by
+  // the leading columns of an existing index, or starting with a rowid
+  // alias, are left out, as reported by `pragma index_list`, `index_info`
+  // and `table_info` on db, which must be a sqlite connection.
+  //
+  std::vector<IndexSuggestion> suggest(const QSqlDatabase& db,
+                                       size_t max = 10) const {
+    std::vector<IndexSuggestion> merged;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::map<std::pair<std::string, std::vector<std::string>>,
+               IndexSuggestion>
+          by_index;
+      for (auto const& shape : _shapes) {
+        for (auto const& candidate : shape.second.candidates) {
+          IndexSuggestion& s = by_index[candidate];
+          s.table = candidate.first;
+          s.columns = candidate.second;
+          s.executions += shape.second.executions;
+          s.total_ms += shape.second.total_ms;
+        }
+      }
+      for (auto const& it : by_index) {
+        merged.push_back(it.second);
+      }
+    }
+
+    // an index also serves every query using a prefix of its columns
+    std::vector<IndexSuggestion> wide;
+    for (auto const& it : merged) {
+      bool folded = false;
+      for (auto& other : merged) {
+        if (&other != &it && other.table == it.table &&
+            is_prefix(it.columns, other.columns)) {
+          folded = true;
+          break;
+        }
+      }
+      if (!folded) {
+        wide.push_back(it);
+      }
+    }
+    for (auto& it : wide) {
+      for (auto const& other : merged) {
+        if (other.table == it.table && other.columns != it.columns &&
+            is_prefix(other.columns, it.columns)) {
+          it.executions += other.executions;
+          it.total_ms += other.total_ms;
+        }
+      }
+    }
+
+    std::map<std::string, Schema> schemas;
+    std::vector<IndexSuggestion> result;
+    for (auto const& it : wide) {
+      if (!schemas.count(it.table)) {
+        schemas[it.table] = schema(db, it.table);
+      }
+      Schema const& existing = schemas[it.table];
+      // a rowid lookup finds at most one row, whatever follows it
+      bool covered = it.columns.front() == existing.rowid;
+      for (auto const& index : existing.indexes) {
+        covered |= is_prefix(it.columns, index);
+      }
+      if (!covered) {
+        result.push_back(it);
+      }
+    }
+
+    std::sort(result.begin(), result.end(),
+              [](const IndexSuggestion& a, const IndexSuggestion& b) {
+                if (a.total_ms != b.total_ms) {
+                  return a.total_ms > b.total_ms;
+                }
+                return a.executions > b.executions;
+              });
+    if (result.size() > max) {
+      result.resize(max);
+    }
+    return result;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _shapes.clear();
+    _usage.clear();
+  }
+
+ private:
+  struct Use {
+    std::string table;
+    std::string column;
+    ColumnUse kind;
+  };
+
+  struct Schema {
+    std::vector<std::vector<std::string>> indexes;
+    // the integer primary key column, if the table has one
+    std::string rowid;
+  };
+
+  struct Shape {
+    std::vector<Use> uses;
+    // (table, columns)
+    std::vector<std::pair<std::string, std::vector<std::string>>> candidates;
+    unsigned long long executions = 0;
+    double total_ms = 0;
+  };
+
+  static bool is_prefix(const std::vector<std::string>& prefix,
+                        const std::vector<std::string>& of) {
+    return prefix.size() <= of.size() &&
+           std::equal(prefix.begin(), prefix.end(), of.begin());
+  }
+
+  static std::string quoted(const std::string& name) {
+    std::string result("\"");
+    for (char c : name) {
+      result.push_back(c);
+      if (c == '"') {
+        result.push_back('"');
+      }
+    }
+    result.push_back('"');
+    return result;
+  }
+
+  static Schema schema(const QSqlDatabase& db, const std::string& table) {
+    Schema result;
+
+    QSqlQuery list(db);
+    std::string sql = "pragma index_list(" + quoted(table) + ")";
+    if (list.exec(sql.c_str())) {
+      while (list.next()) {
+        // seq, name, unique, origin, partial
+        std::string name = list.value(1).toString().toStdString();
+        QSqlQuery info(db);
+        std::string info_sql = "pragma index_info(" + quoted(name) + ")";
+        std::vector<std::string> columns;
+        if (info.exec(info_sql.c_str())) {
+          // seqno, cid, name
+          while (info.next()) {
+            columns.push_back(info.value(2).toString().toStdString());
+          }
+        }
+        result.indexes.push_back(columns);
+      }
+    }
+
+    QSqlQuery columns(db);
+    std::string table_sql = "pragma table_info(" + quoted(table) + ")";
+    if (columns.exec(table_sql.c_str())) {
+      // cid, name, type, notnull, dflt_value, pk
+      std::vector<std::string> pk;
+      bool integer = false;
+      while (columns.next()) {
+        if (columns.value(5).toInt() > 0) {
+          pk.push_back(columns.value(1).toString().toStdString());
+          integer = columns.value(2).toString().toUpper() == "INTEGER";
+        }
+      }
+      if (pk.size() == 1 && integer) {
+        result.rowid = pk.front();
+      }
+    }
+    return result;
+  }
+
+  // table name for each alias or name used in the from and join clauses
+  static void add_table(const Identifier& source,
+                        std::map<std::string, std::string>& tables) {
+    std::vector<std::string> words;
+    std::string word;
+    for (char c : source.str() + " ") {
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        if (!word.empty()) {
+          words.push_back(word);
+          word.clear();
+        }
+      } else {
+        word.push_back(c);
+      }
+    }
+    if (words.empty()) {
+      return;
+    }
+    tables[words.front()] = words.front();
+    tables[words.back()] = words.front();
+  }
+
+  static void add_use(const std::string& column, ColumnUse kind,
+                      const std::map<std::string, std::string>& tables,
+                      const std::string& first_table,
+                      std::vector<Use>& uses) {
+    Use use;
+    use.kind = kind;
+    size_t dot = column.rfind('.');
+    if (dot == std::string::npos) {
+      use.table = first_table;
+      use.column = column;
+    } else {
+      auto it = tables.find(column.substr(0, dot));
+      use.table = it == tables.end() ? column.substr(0, dot) : it->second;
+      use.column = column.substr(dot + 1);
+    }
+    if (!use.table.empty() && !use.column.empty()) {
+      uses.push_back(use);
+    }
+  }
+
+  static void analyze(SqlModel& model, Shape& shape) {
+    std::map<std::string, std::string> tables;
+    std::string first_table;
+    const std::vector<std::pair<Identifier, ColumnUse>>* conditions = nullptr;
+
+    if (auto select = dynamic_cast<SelectModel*>(&model)) {
+      for (auto const& it : select->_tables) {
+        add_table(it, tables);
+      }
+      if (select->_join_type) {
+        add_table(select->_join_table, tables);
+      }
+      if (!select->_tables.empty()) {
+        std::map<std::string, std::string> first;
+        add_table(select->_tables.front(), first);
+        first_table = first.begin()->second;
+      }
+      conditions = &select->_column_uses;
+
+      for (auto const& it : select->_groupby_columns) {
+        add_use(it.str(), ColumnUse::GROUP, tables, first_table, shape.uses);
+      }
+      for (auto const& it : order_by_terms(select->_order_by)) {
+        add_use(it.first, ColumnUse::SORT, tables, first_table, shape.uses);
+      }
+    } else if (auto update = dynamic_cast<UpdateModel*>(&model)) {
+      add_table(update->_table_name, tables);
+      first_table = update->_table_name.str();
+      conditions = &update->_column_uses;
+    } else if (auto remove = dynamic_cast<DeleteModel*>(&model)) {
+      for (auto const& it : remove->_tables) {
+        add_table(it, tables);
+      }
+      if (!remove->_tables.empty()) {
+        first_table = remove->_tables.front().str();
+      }
+      conditions = &remove->_column_uses;
+    } else {
+      return;
+    }
+
+    for (auto const& it : *conditions) {
+      add_use(it.first.str(), it.second, tables, first_table, shape.uses);
+    }
+
+    // one candidate per table: equality and join columns, then a range
+    // column, or the grouping or sort columns when nothing is a range
+    std::map<std::string, std::vector<std::string>> eq, range, group, sort;
+    for (auto const& it : shape.uses) {
+      std::vector<std::string>* list = nullptr;
+      switch (it.kind) {
+        case ColumnUse::EQUALITY:
+        case ColumnUse::JOIN:
+          list = &eq[it.table];
+          break;
+        case ColumnUse::RANGE:
+          list = &range[it.table];
+          break;
+        case ColumnUse::GROUP:
+          list = &group[it.table];
+          break;
+        case ColumnUse::SORT:
+          list = &sort[it.table];
+          break;
+      }
+      if (std::find(list->begin(), list->end(), it.column) == list->end()) {
+        list->push_back(it.column);
+      }
+    }
+
+    std::map<std::string, bool> seen;
+    for (auto const& it : shape.uses) {
+      seen[it.table] = true;
+    }
+    for (auto const& it : seen) {
+      std::string const& table = it.first;
+      std::vector<std::string> columns = eq[table];
+      std::vector<std::string> tail;
+      if (!range[table].empty()) {
+        tail.push_back(range[table].front());
+      } else if (!group[table].empty()) {
+        tail = group[table];
+      } else {
+        tail = sort[table];
+      }
+      for (auto const& column : tail) {
+        if (std::find(columns.begin(), columns.end(), column) ==
+            columns.end()) {
+          columns.push_back(column);
+        }
+      }
+      if (!columns.empty()) {
+        shape.candidates.push_back(std::make_pair(table, columns));
+      }
+    }
+  }
+
+  mutable std::mutex _mutex;
+  std::unordered_map<std::string, Shape> _shapes;
+  std::map<std::pair<std::string, std::string>, ColumnUsage> _usage;
+};
+
+}  // namespace sql_builder
@@ -0,0 +1,143 @@
+/**
+ * Large binary values without whole-value copies.
+ *
+ * BlobRef binds borrowed memory, and MappedBlob a memory-mapped file, as a
+ * blob parameter without copying it. ZeroBlob inserts a zero-filled blob of
+ * a given size, to be filled in through a BlobStream (sql_blob_stream.h).
+ */
+#pragma once
+
+#include <QByteArray>
+#include <QFile>
+#include <climits>
+
+#include "sql.h"
+
+namespace sql_builder {
+
+//
+// Memory bound as a blob without being copied. It must stay valid and
+// unchanged until the statement using it has run.
+//
+// QByteArray sizes are ints, so a value over INT_MAX bytes cannot be bound.
+// Inserting or setting one renders a call to the undefined function
+// blob_too_large() in its place, so the statement fails to prepare and exec()
+// returns false with the database's error rather than storing a null or a
+// truncated value. Write such values through a ZeroBlob and a BlobStream.
+//
+struct BlobRef {
+  const char* data;
+  size_t size;
+
+  bool too_large() const { return size > static_cast<size_t>(INT_MAX); }
+};
+
+// the placeholder of a BlobRef; unknown to every database, see above
+inline const char* blob_placeholder(const BlobRef& data) {
+  return data.too_large() ? "blob_too_large()" : "?";
+}
+
+// an oversized blob converts to a null; only insert and set reject it
+template <>
+inline QVariant to_variant<BlobRef>(const BlobRef& data) {
+  if (data.size == 0) {
+    // fromRawData(nullptr, 0) would be a null, not an empty, blob
+    return QByteArray("", 0);
+  }
+  if (data.too_large()) {
+    return QVariant();
+  }
+  return QByteArray::fromRawData(data.data, static_cast<int>(data.size));
+}
+
+template <>
+inline InsertModel& InsertModel::insert(const Identifier& c,
+                                        const BlobRef& data) {
+  _columns.push_back(c);
+  _row.push_back(to_variant(data));
+  _values.push_back(blob_placeholder(data));
+  if (!data.too_large()) {
+    _value_bindings.push_back(to_variant(data));
+  }
+  return *this;
+}
+
+template <>
+inline UpdateModel& UpdateModel::set(const Identifier& c, const BlobRef& data,
+                                     bool) {
+  _set_columns.push_back(c);
+  _set_values.push_back(blob_placeholder(data));
+  if (!data.too_large()) {
+    _set_bindings.push_back(to_variant(data));
+  }
+  return *this;
+}
+
+//
+// A read only memory mapping of a file, bindable through blob(). The file
+// stays mapped for the life of the object. Files over INT_MAX bytes are not
+// mapped and is_open() is false for them, but blob() keeps their size, so
+// binding one fails like any oversized BlobRef.
+//
+class MappedBlob {
+ public:
+  explicit MappedBlob(const QString& path)
+      : _file(path), _data(nullptr), _size(0) {
+    if (_file.open(QIODevice::ReadOnly)) {
+      _size = _file.size();
+      if (_size > 0 && _size <= INT_MAX) {
+        _data = _file.map(0, _size);
+      }
+    }
+  }
+
+  ~MappedBlob() {
+    if (_data) {
+      _file.unmap(_data);
+    }
+  }
+
+  bool is_open() const { return _file.isOpen() && (_data || _size == 0); }
+
+  BlobRef blob() const {
+    return BlobRef{reinterpret_cast<const char*>(_data),
+                   static_cast<size_t>(_size)};
+  }
+
+ private:
+  MappedBlob(const MappedBlob&) = delete;
+  MappedBlob& operator=(const MappedBlob&) = delete;
+
+  QFile _file;
+  uchar* _data;
+  qint64 _size;
+};
+
+//
+// A zero-filled blob of the given size, rendered as zeroblob(?), to be filled
+// in afterwards through a BlobStream.
+//
+struct ZeroBlob {
+  qint64 size;
+};
+
+template <>
+inline InsertModel& InsertModel::insert(const Identifier& c,
+                                        const ZeroBlob& data) {
+  _columns.push_back(c);
+  _row.push_back(QVariant());
+  _values.push_back("zeroblob(?)");
+  _value_bindings.push_back(data.size);
+  return *this;
+}
+
+template <>
+inline UpdateModel& UpdateModel::set(const Identifier& c,
+                                     const ZeroBlob& data, bool) {
+  _set_columns.push_back(c);
+  _set_values.push_back("zeroblob(?)");
+  _set_bindings.push_back(data.size);
+  return *this;
+}
+
+}  // namespace sql_builder
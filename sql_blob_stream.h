@@ -0,0 +1,125 @@
+/**
+ * Incremental reads and writes of sqlite blobs.
+ *
+ * BlobStream calls into libsqlite3 with the handle of a QSQLITE connection,
+ * so Qt must use the same sqlite library (a -system-sqlite build, as shipped
+ * by Linux distributions), and users of this header link libsqlite3. The
+ * rest of sql_blob.h has no such dependency.
+ */
+#pragma once
+
+#include <sqlite3.h>
+
+#include <QSqlDatabase>
+#include <QSqlDriver>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "sql_blob.h"
+
+namespace sql_builder {
+
+//
+// Incremental access to one blob value in a sqlite database, addressed by
+// table, column and rowid:
+//
+//   BlobStream blob(db, "file", "data", rowid);
+//   blob.read_chunks(64 * 1024, [&](const char* data, int size) {
+//     hash.addData(data, size);
+//   });
+//
+// Writes cannot change the size of the value; insert a ZeroBlob first. A
+// stream is invalidated (reads and writes fail) when its row is changed
+// other than through the stream.
+//
+class BlobStream {
+ public:
+  BlobStream(const QSqlDatabase& db, const std::string& table,
+             const std::string& column, qint64 rowid, bool writable = false,
+             const std::string& schema = "main")
+      : _blob(nullptr) {
+    sqlite3* handle = nullptr;
+    QSqlDriver* driver = db.driver();
+    QVariant v = driver ? driver->handle() : QVariant();
+    if (v.isValid() && std::strcmp(v.typeName(), "sqlite3*") == 0) {
+      handle = *static_cast<sqlite3**>(v.data());
+    }
+    if (!handle) {
+      _error = "not an open sqlite connection";
+      return;
+    }
+    if (sqlite3_blob_open(handle, schema.c_str(), table.c_str(),
+                          column.c_str(), rowid, writable ? 1 : 0,
+                          &_blob) != SQLITE_OK) {
+      _error = sqlite3_errmsg(handle);
+      sqlite3_blob_close(_blob);
+      _blob = nullptr;
+    }
+  }
+
+  ~BlobStream() { close(); }
+
+  bool is_open() const { return _blob != nullptr; }
+  const std::string& error() const { return _error; }
+
+  int size() const { return _blob ? sqlite3_blob_bytes(_blob) : 0; }
+
+  bool read(char* buffer, int length, int offset) {
+    return check(_blob &&
+                 sqlite3_blob_read(_blob, buffer, length, offset) == SQLITE_OK);
+  }
+
+  bool write(const char* data, int length, int offset) {
+    return check(_blob && sqlite3_blob_write(_blob, data, length, offset) ==
+                              SQLITE_OK);
+  }
+
+  // move to the same column of another row, cheaper than a new stream
+  bool reopen(qint64 rowid) {
+    return check(_blob && sqlite3_blob_reopen(_blob, rowid) == SQLITE_OK);
+  }
+
+  // call f(data, size) for consecutive chunks of at most chunk_size bytes
+  template <typename F>
+  bool read_chunks(int chunk_size, F f) {
+    if (chunk_size <= 0) {
+      _error = "chunk size must be positive";
+      return false;
+    }
+    std::vector<char> buffer(chunk_size);
+    int total = size();
+    for (int offset = 0; offset < total; offset += chunk_size) {
+      int n = std::min(chunk_size, total - offset);
+      if (!read(buffer.data(), n, offset)) {
+        return false;
+      }
+      f(buffer.data(), n);
+    }
+    return true;
+  }
+
+  void close() {
+    if (_blob) {
+      sqlite3_blob_close(_blob);
+      _blob = nullptr;
+    }
+  }
+
+ private:
+  BlobStream(const BlobStream&) = delete;
+  BlobStream& operator=(const BlobStream&) = delete;
+
+  bool check(bool ok) {
+    if (!ok) {
+      _error = _blob ? "blob read or write failed" : "blob is not open";
+    }
+    return ok;
+  }
+
+  sqlite3_blob* _blob;
+  std::string _error;
+};
+
+}  // namespace sql_builder
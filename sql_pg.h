@@ -0,0 +1,733 @@
+/**
+ * PostgreSQL backend for the sql builder models, talking to libpq directly
+ * instead of going through QSqlQuery.
+ *
+ * Statements are sent with `$1..$n` placeholders, typed parameters and
+ * results use the binary wire format, and a Connection can be switched into
+ * pipeline mode so that many models are sent without waiting for each reply.
+ */
+#pragma once
+
+#include <libpq-fe.h>
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QString>
+#include <QVariant>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "sql.h"
+
+#if !defined(LIBPQ_HAS_PIPELINING)
+#error "sql_pg.h needs libpq 14 or newer for pipeline mode"
+#endif
+
+namespace sql_builder {
+namespace pg {
+
+// type oids from pg_type.h, which is not part of the client headers
+enum : Oid {
+  TYPE_BOOL = 16,
+  TYPE_BYTEA = 17,
+  TYPE_NAME = 19,
+  TYPE_INT8 = 20,
+  TYPE_INT2 = 21,
+  TYPE_INT4 = 23,
+  TYPE_TEXT = 25,
+  TYPE_OID = 26,
+  TYPE_JSON = 114,
+  TYPE_FLOAT4 = 700,
+  TYPE_FLOAT8 = 701,
+  TYPE_BPCHAR = 1042,
+  TYPE_VARCHAR = 1043,
+  TYPE_DATE = 1082,
+  TYPE_TIME = 1083,
+  TYPE_TIMESTAMP = 1114,
+  TYPE_TIMESTAMPTZ = 1184,
+  TYPE_NUMERIC = 1700,
+  TYPE_UUID = 2950,
+  TYPE_JSONB = 3802
+};
+
+//
+// Rewrite the `?` placeholders produced by the models into postgres style
+// `$1..$n`. Question marks inside quoted literals and identifiers are kept.
+//
+inline std::string number_placeholders(const std::string& sql) {
+  std::string result;
+  result.reserve(sql.size() + 16);
+  int n = 0;
+  char quote = 0;
+  for (char c : sql) {
+    if (quote) {
+      // a doubled quote simply closes and reopens, so no lookahead is needed
+      if (c == quote) {
+        quote = 0;
+      }
+      result.push_back(c);
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      result.push_back(c);
+    } else if (c == '?') {
+      result.push_back('$');
+      result.append(std::to_string(++n));
+    } else {
+      result.push_back(c);
+    }
+  }
+  return result;
+}
+
+//
+// Bound values encoded for PQsendQueryParams. Integers, floats, booleans and
+// byte arrays go out in binary with an explicit type; strings are sent as
+// untyped text so the server infers the type from the statement, which keeps
+// dates, numerics etc. working. Dates and times go out as ISO 8601 text, with
+// the offset of a QDateTime.
+//
+class Params {
+ public:
+  explicit Params(const QVariantList& bindings) {
+    int size = bindings.size();
+    _types.reserve(size);
+    _storage.reserve(size);
+    _lengths.reserve(size);
+    _formats.reserve(size);
+    for (auto const& it : bindings) {
+      encode(it);
+    }
+    // pointers are taken once storage no longer moves
+    _values.reserve(size);
+    for (int i = 0; i < size; ++i) {
+      _values.push_back(_nulls[i] ? nullptr : _storage[i].data());
+    }
+  }
+
+  int size() const { return static_cast<int>(_types.size()); }
+  const Oid* types() const { return _types.data(); }
+  const char* const* values() const { return _values.data(); }
+  const int* lengths() const { return _lengths.data(); }
+  const int* formats() const { return _formats.data(); }
+
+  // the type list takes part in the prepared statement cache key
+  std::string signature() const {
+    std::string sig;
+    for (auto type : _types) {
+      sig.append(std::to_string(type));
+      sig.push_back(',');
+    }
+    return sig;
+  }
+
+ private:
+  void encode(const QVariant& value) {
+    if (value.isNull()) {
+      push(0, std::string(), 1, true);
+      return;
+    }
+    switch (value.userType()) {
+      case QMetaType::Bool:
+        push(TYPE_BOOL, std::string(1, value.toBool() ? 1 : 0), 1);
+        break;
+      case QMetaType::Char:
+      case QMetaType::SChar:
+      case QMetaType::UChar:
+      case QMetaType::Short:
+      case QMetaType::UShort:
+      case QMetaType::Int:
+      case QMetaType::UInt:
+      case QMetaType::Long:
+      case QMetaType::LongLong:
+        push(TYPE_INT8, big_endian(static_cast<uint64_t>(value.toLongLong())),
+             1);
+        break;
+      case QMetaType::ULong:
+      case QMetaType::ULongLong: {
+        qulonglong v = value.toULongLong();
+        if (v > static_cast<qulonglong>(INT64_MAX)) {
+          push(TYPE_NUMERIC, std::to_string(v), 0);
+        } else {
+          push(TYPE_INT8, big_endian(v), 1);
+        }
+        break;
+      }
+      case QMetaType::Float:
+      case QMetaType::Double: {
+        double d = value.toDouble();
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        push(TYPE_FLOAT8, big_endian(bits), 1);
+        break;
+      }
+      case QMetaType::QByteArray: {
+        QByteArray ba = value.toByteArray();
+        push(TYPE_BYTEA, std::string(ba.constData(), ba.size()), 1);
+        break;
+      }
+      case QMetaType::QDateTime: {
+        // ISO 8601 with an explicit offset, which the server always parses;
+        // toString() of a local time has neither
+        QDateTime time = value.toDateTime();
+        if (time.timeSpec() == Qt::LocalTime) {
+          time = time.toOffsetFromUtc(time.offsetFromUtc());
+        }
+        text(time.toString(Qt::ISODateWithMs));
+        break;
+      }
+      case QMetaType::QDate:
+        text(value.toDate().toString(Qt::ISODate));
+        break;
+      case QMetaType::QTime:
+        text(value.toTime().toString(Qt::ISODateWithMs));
+        break;
+      default:
+        text(value.toString());
+        break;
+    }
+  }
+
+  // untyped, for the server to infer from the statement
+  void text(const QString& value) {
+    QByteArray utf8 = value.toUtf8();
+    push(0, std::string(utf8.constData(), utf8.size()), 0);
+  }
+
+  void push(Oid type, std::string data, int format, bool null = false) {
+    _types.push_back(type);
+    _lengths.push_back(static_cast<int>(data.size()));
+    _formats.push_back(format);
+    _nulls.push_back(null);
+    _storage.push_back(std::move(data));
+  }
+
+  static std::string big_endian(uint64_t v) {
+    std::string out(8, '\0');
+    for (int i = 7; i >= 0; --i) {
+      out[i] = static_cast<char>(v & 0xff);
+      v >>= 8;
+    }
+    return out;
+  }
+
+  std::vector<Oid> _types;
+  std::vector<std::string> _storage;
+  std::vector<bool> _nulls;
+  std::vector<const char*> _values;
+  std::vector<int> _lengths;
+  std::vector<int> _formats;
+};
+
+//
+// Owns a PGresult and decodes its binary columns into QVariants. Numerics
+// come back as their decimal text, dates, times and timestamps as QDate,
+// QTime and QDateTime (in UTC for timestamptz, to millisecond precision), and
+// json and uuid as text. Types without a decoder come back as the raw bytes
+// of their binary representation.
+//
+class Result {
+ public:
+  Result() : _res(nullptr) {}
+  explicit Result(PGresult* res) : _res(res) {}
+  Result(Result&& other) : _res(other._res) { other._res = nullptr; }
+  Result& operator=(Result&& other) {
+    if (this != &other) {
+      PQclear(_res);
+      _res = other._res;
+      other._res = nullptr;
+    }
+    return *this;
+  }
+  ~Result() { PQclear(_res); }
+
+  bool ok() const {
+    auto s = status();
+    return s == PGRES_TUPLES_OK || s == PGRES_COMMAND_OK;
+  }
+
+  ExecStatusType status() const {
+    return _res ? PQresultStatus(_res) : PGRES_FATAL_ERROR;
+  }
+
+  std::string error() const {
+    return _res ? PQresultErrorMessage(_res) : "no result";
+  }
+
+  int rows() const { return _res ? PQntuples(_res) : 0; }
+  int columns() const { return _res ? PQnfields(_res) : 0; }
+
+  // number of rows touched by an insert, update or delete
+  int affected() const {
+    return _res ? std::atoi(PQcmdTuples(_res)) : 0;
+  }
+
+  QVariant value(int row, int column) const {
+    if (PQgetisnull(_res, row, column)) {
+      return QVariant();
+    }
+    const char* data = PQgetvalue(_res, row, column);
+    int length = PQgetlength(_res, row, column);
+    if (PQfformat(_res, column) == 0) {
+      return QString::fromUtf8(data, length);
+    }
+    switch (PQftype(_res, column)) {
+      case TYPE_BOOL:
+        return data[0] != 0;
+      case TYPE_INT2:
+        return static_cast<qint16>(from_big_endian(data, 2));
+      case TYPE_INT4:
+        return static_cast<qint32>(from_big_endian(data, 4));
+      case TYPE_OID:
+        return static_cast<quint32>(from_big_endian(data, 4));
+      case TYPE_INT8:
+        return static_cast<qint64>(from_big_endian(data, 8));
+      case TYPE_FLOAT4: {
+        uint32_t bits = static_cast<uint32_t>(from_big_endian(data, 4));
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+      }
+      case TYPE_FLOAT8: {
+        uint64_t bits = from_big_endian(data, 8);
+        double d;
+        std::memcpy(&d, &bits, sizeof(d));
+        return d;
+      }
+      case TYPE_TEXT:
+      case TYPE_VARCHAR:
+      case TYPE_BPCHAR:
+      case TYPE_NAME:
+      case TYPE_JSON:
+        return QString::fromUtf8(data, length);
+      case TYPE_JSONB:
+        // a version byte, then the text
+        return QString::fromUtf8(data + 1, length - 1);
+      case TYPE_NUMERIC:
+        return numeric(data);
+      case TYPE_DATE: {
+        qint32 days = static_cast<qint32>(from_big_endian(data, 4));
+        if (days == INT32_MAX || days == INT32_MIN) {
+          return QString(days > 0 ? "infinity" : "-infinity");
+        }
+        return epoch().addDays(days);
+      }
+      case TYPE_TIME:
+        return QTime::fromMSecsSinceStartOfDay(
+            static_cast<int>(from_big_endian(data, 8) / 1000));
+      case TYPE_TIMESTAMP:
+      case TYPE_TIMESTAMPTZ: {
+        qint64 us = static_cast<qint64>(from_big_endian(data, 8));
+        if (us == INT64_MAX || us == INT64_MIN) {
+          return QString(us > 0 ? "infinity" : "-infinity");
+        }
+        // whole days and the time within the day, rounding towards the past
+        qint64 day = 86400000000LL;
+        qint64 days = us / day - (us % day < 0 ? 1 : 0);
+        QDateTime time(epoch().addDays(days),
+                       QTime::fromMSecsSinceStartOfDay(
+                           static_cast<int>((us - days * day) / 1000)),
+                       PQftype(_res, column) == TYPE_TIMESTAMPTZ
+                           ? Qt::UTC
+                           : Qt::LocalTime);
+        return time;
+      }
+      case TYPE_UUID: {
+        static const char hex[] = "0123456789abcdef";
+        std::string text;
+        for (int i = 0; i < 16; ++i) {
+          if (i == 4 || i == 6 || i == 8 || i == 10) {
+            text.push_back('-');
+          }
+          text.push_back(hex[static_cast<unsigned char>(data[i]) >> 4]);
+          text.push_back(hex[data[i] & 0xf]);
+        }
+        return QString::fromStdString(text);
+      }
+      default:
+        // bytea and anything without a decoder: raw binary representation
+        return QByteArray(data, length);
+    }
+  }
+
+  PGresult* handle() const { return _res; }
+
+ private:
+  Result(const Result&) = delete;
+  Result& operator=(const Result&) = delete;
+
+  // dates and timestamps count from 2000-01-01
+  static QDate epoch() { return QDate(2000, 1, 1); }
+
+  // the decimal text of a binary numeric, as the text format would give it,
+  // so that no precision is lost
+  static QString numeric(const char* data) {
+    int digits = static_cast<qint16>(from_big_endian(data, 2));
+    int weight = static_cast<qint16>(from_big_endian(data + 2, 2));
+    uint16_t sign = static_cast<uint16_t>(from_big_endian(data + 4, 2));
+    int scale = static_cast<qint16>(from_big_endian(data + 6, 2));
+    switch (sign) {
+      case 0xc000:
+        return QString("NaN");
+      case 0xd000:
+        return QString("Infinity");
+      case 0xf000:
+        return QString("-Infinity");
+    }
+    // base 10000 digits, the first one worth 10000^weight
+    auto digit = [data, digits](int i) {
+      return i >= 0 && i < digits
+                 ? static_cast<int>(from_big_endian(data + 8 + 2 * i, 2))
+                 : 0;
+    };
+
+    std::string text = sign == 0x4000 ? "-" : "";
+    if (weight < 0) {
+      text.push_back('0');
+    }
+    for (int i = 0; i <= weight; ++i) {
+      std::string group = std::to_string(digit(i));
+      if (i > 0) {
+        group.insert(0, 4 - group.size(), '0');
+      }
+      text.append(group);
+    }
+    if (scale > 0) {
+      text.push_back('.');
+      std::string fraction;
+      for (int i = weight + 1; static_cast<int>(fraction.size()) < scale;
+           ++i) {
+        std::string group = std::to_string(digit(i));
+        fraction.append(4 - group.size(), '0');
+        fraction.append(group);
+      }
+      text.append(fraction, 0, scale);
+    }
+    return QString::fromStdString(text);
+  }
+
+  static uint64_t from_big_endian(const char* data, int size) {
+    uint64_t v = 0;
+    for (int i = 0; i < size; ++i) {
+      v = (v << 8) | static_cast<unsigned char>(data[i]);
+    }
+    return v;
+  }
+
+  PGresult* _res;
+};
+
+//
+// A libpq connection that executes models.
+//
+// Every distinct statement (sql text plus parameter types) is prepared once
+// per connection and then executed by name. At most `statements` of them are
+// kept; the least recently used is deallocated on the server to make room,
+// so that statements with inlined literals, each used once, do not pile up.
+//
+// In pipeline mode `send` only queues the model, `sync` flushes the queue to
+// the server and `next_result` hands back the replies in send order:
+//
+//   conn.begin_pipeline();
+//   for (...) {
+//     i.reset().insert("id", n)("name", name).into("user");
+//     conn.send(i);
+//   }
+//   conn.sync();
+//   while (conn.pending()) {
+//     pg::Result r = conn.next_result();
+//     ...
+//   }
+//   conn.end_pipeline();
+//
+// The connection stays in blocking mode, so keep batches between syncs to a
+// size whose replies fit the socket buffers (a few thousand small writes).
+//
+class Connection {
+ public:
+  explicit Connection(const std::string& conninfo, size_t statements = 256)
+      : _conn(PQconnectdb(conninfo.c_str())),
+        _capacity(std::max<size_t>(statements, 1)),
+        _next_statement(0),
+        _syncs(0) {}
+  ~Connection() { PQfinish(_conn); }
+
+  bool is_open() const { return _conn && PQstatus(_conn) == CONNECTION_OK; }
+
+  std::string last_error() const {
+    return _conn ? PQerrorMessage(_conn) : "out of memory";
+  }
+
+  PGconn* handle() const { return _conn; }
+
+  // execute a model and wait for its result, outside of pipeline mode
+  Result exec(SqlModel& model) {
+    std::string sql = number_placeholders(model.str());
+    Params params(model.bindings());
+    std::string key = sql + '\0' + params.signature();
+    std::string name = statement(key);
+    if (name.empty()) {
+      name = remember(key);
+      deallocate_stale();
+      Result prepared(PQprepare(_conn, name.c_str(), sql.c_str(),
+                                params.size(), params.types()));
+      if (!prepared.ok()) {
+        forget(key);
+        return prepared;
+      }
+      confirm(key);
+    }
+    return Result(PQexecPrepared(_conn, name.c_str(), params.size(),
+                                 params.values(), params.lengths(),
+                                 params.formats(), 1));
+  }
+
+  bool begin_pipeline() { return PQenterPipelineMode(_conn) == 1; }
+
+  // only succeeds once the result of every sent model has been read through
+  // next_result(); until then nothing is consumed and the pipeline stays on,
+  // so that results are still handed to the models they belong to
+  bool end_pipeline() {
+    if (pending() > 0) {
+      return false;
+    }
+    if (!_queue.empty()) {
+      // deallocations sent ahead of a model that then failed to send
+      next_result();
+      if (!_queue.empty()) {
+        return false;
+      }
+    }
+    // only sync markers are left to read
+    while (_syncs > 0) {
+      PGresult* res = PQgetResult(_conn);
+      if (!res) {
+        break;
+      }
+      if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+        --_syncs;
+      }
+      PQclear(res);
+    }
+    if (PQexitPipelineMode(_conn) != 1) {
+      return false;
+    }
+    // statements prepared in the pipeline may have outgrown the cache
+    trim(_capacity);
+    deallocate_stale();
+    return true;
+  }
+
+  bool in_pipeline() const {
+    return PQpipelineStatus(_conn) != PQ_PIPELINE_OFF;
+  }
+
+  // queue a model for execution in pipeline mode
+  bool send(SqlModel& model) {
+    std::string sql = number_placeholders(model.str());
+    Params params(model.bindings());
+    std::string key = sql + '\0' + params.signature();
+    std::string name = statement(key);
+    if (name.empty()) {
+      name = remember(key);
+      while (!_stale.empty()) {
+        std::string deallocate = "deallocate " + _stale.back();
+        if (!PQsendQueryParams(_conn, deallocate.c_str(), 0, nullptr,
+                               nullptr, nullptr, nullptr, 0)) {
+          forget(key);
+          return false;
+        }
+        _queue.push_back(Awaited{Awaited::DEALLOCATE, _stale.back()});
+        _stale.pop_back();
+      }
+      if (!PQsendPrepare(_conn, name.c_str(), sql.c_str(), params.size(),
+                         params.types())) {
+        forget(key);
+        return false;
+      }
+      _queue.push_back(Awaited{Awaited::PREPARE, key});
+    }
+    if (!PQsendQueryPrepared(_conn, name.c_str(), params.size(),
+                             params.values(), params.lengths(),
+                             params.formats(), 1)) {
+      return false;
+    }
+    _queue.push_back(Awaited{Awaited::MODEL, std::string()});
+    return true;
+  }
+
+  // mark a sync point and flush everything queued so far to the server
+  bool sync() {
+    if (!PQpipelineSync(_conn)) {
+      return false;
+    }
+    ++_syncs;
+    return true;
+  }
+
+  // number of sent models whose result has not been read yet
+  int pending() const {
+    int n = 0;
+    for (auto const& it : _queue) {
+      if (it.kind == Awaited::MODEL) {
+        ++n;
+      }
+    }
+    return n;
+  }
+
+  // the result of the oldest sent model; blocks until it arrives
+  Result next_result() {
+    while (!_queue.empty()) {
+      Result result(read());
+      if (!result.handle()) {
+        // connection trouble, or results requested without a sync
+        return result;
+      }
+
+      Awaited awaited = _queue.front();
+      _queue.pop_front();
+      if (awaited.kind == Awaited::MODEL) {
+        return result;
+      }
+      if (awaited.kind == Awaited::DEALLOCATE) {
+        if (result.status() == PGRES_PIPELINE_ABORTED) {
+          // skipped with the rest of its segment; the statement still exists
+          _stale.push_back(awaited.text);
+        }
+        continue;
+      }
+      if (result.ok()) {
+        confirm(awaited.text);
+      } else {
+        // the failed prepare is reported in place of the model that needed
+        // it, whose own result is only an abort notice
+        forget(awaited.text);
+        Result aborted(read());
+        _queue.pop_front();
+        return result;
+      }
+    }
+    return Result();
+  }
+
+ private:
+  Connection(const Connection&) = delete;
+  Connection& operator=(const Connection&) = delete;
+
+  // the name of the statement prepared for key, or an empty string
+  std::string statement(const std::string& key) {
+    auto it = _statements.find(key);
+    if (it == _statements.end()) {
+      return std::string();
+    }
+    _recent.splice(_recent.begin(), _recent, it->second);
+    return it->second->name;
+  }
+
+  // a new statement name for key, evicting the least recently used statement
+  // into _stale when the cache is full. Only statements known to exist on the
+  // server are evicted, as deallocating one that does not would fail and
+  // abort whatever follows it in the pipeline.
+  std::string remember(const std::string& key) {
+    trim(_capacity - 1);
+    std::string name = "sb" + std::to_string(_next_statement++);
+    _recent.push_front(Statement{key, name, false});
+    _statements.emplace(key, _recent.begin());
+    return name;
+  }
+
+  // evict statements into _stale, least recently used first, until at most
+  // size are left or only unconfirmed ones remain
+  void trim(size_t size) {
+    for (auto it = _recent.end();
+         _statements.size() > size && it != _recent.begin();) {
+      --it;
+      if (it->prepared) {
+        _stale.push_back(it->name);
+        _statements.erase(it->key);
+        it = _recent.erase(it);
+      }
+    }
+  }
+
+  // outside of pipeline mode only
+  void deallocate_stale() {
+    while (!_stale.empty()) {
+      std::string deallocate = "deallocate " + _stale.back();
+      Result(PQexec(_conn, deallocate.c_str()));
+      _stale.pop_back();
+    }
+  }
+
+  // the prepare of key succeeded
+  void confirm(const std::string& key) {
+    auto it = _statements.find(key);
+    if (it != _statements.end()) {
+      it->second->prepared = true;
+    }
+  }
+
+  // drop a statement whose prepare failed; its name is not reused
+  void forget(const std::string& key) {
+    auto it = _statements.find(key);
+    if (it != _statements.end()) {
+      _recent.erase(it->second);
+      _statements.erase(it);
+    }
+  }
+
+  // next query result, skipping sync markers and eating the null separator
+  // that follows every query result
+  PGresult* read() {
+    while (true) {
+      PGresult* res = PQgetResult(_conn);
+      if (!res || PQresultStatus(res) != PGRES_PIPELINE_SYNC) {
+        if (res) {
+          PQgetResult(_conn);
+        }
+        return res;
+      }
+      --_syncs;
+      PQclear(res);
+    }
+  }
+
+  // a result the pipeline is waiting for
+  struct Awaited {
+    enum Kind { MODEL, PREPARE, DEALLOCATE };
+    Kind kind;
+    // the statement key of a prepare, the statement name of a deallocate
+    std::string text;
+  };
+
+  struct Statement {
+    std::string key;
+    std::string name;
+    // the server has confirmed the prepare
+    bool prepared;
+  };
+
+  typedef std::list<Statement> Recent;
+
+  PGconn* _conn;
+  // most recently used first
+  Recent _recent;
+  std::unordered_map<std::string, Recent::iterator> _statements;
+  size_t _capacity;
+  // evicted statements still to be deallocated on the server
+  std::vector<std::string> _stale;
+  // names are never reused, as entries whose prepare failed are erased
+  uint64_t _next_statement;
+  std::deque<Awaited> _queue;
+  int _syncs;
+};
+
+}  // namespace pg
+}  // namespace sql_builder
@@ -0,0 +1,243 @@
+/**
+ * Registry of the statement shapes a service runs, declared at startup, so
+ * that each new connection prepares them all up front instead of paying for
+ * it on the first requests. The prepared statements are kept per connection
+ * and handed out for models to execute on.
+ */
+#pragma once
+
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "sql.h"
+
+namespace sql_builder {
+
+struct WarmupReport {
+  QString connection;
+  double elapsed_ms = 0;
+  int prepared = 0;
+  // selects run once with every binding null
+  int executed = 0;
+  // name and error of each shape that failed to prepare or run
+  std::vector<std::pair<std::string, QString>> failures;
+};
+
+//
+// Services declare their shapes once:
+//
+//   SelectModel by_id;
+//   by_id.select("id", "name").from("user").where(Column("id") == 0);
+//   StatementRegistry::instance().add("user.by_id", by_id);
+//
+// Names are unique; add() refuses a name that is already registered.
+//
+// and open pooled connections through the registry:
+//
+//   StatementRegistry::instance().on_warm_up([](const WarmupReport& r) {
+//     ...
+//   });
+//   StatementRegistry::instance().open(db);
+//
+// and execute on the statements prepared there:
+//
+//   QSqlQuery query = StatementRegistry::instance().query(db, "user.by_id");
+//   SelectModel by_id;
+//   by_id.select("id", "name").from("user").where(Column("id") == id);
+//   by_id.exec_prepared(query);
+//
+// Only the rendered sql and the number of bindings are kept; the values used
+// to declare a shape do not matter. exec_prepared() checks that the model
+// renders the statement it is given, preparing it again if not. Call release() before closing or removing
+// a connection, which drops the statements kept for it.
+//
+class StatementRegistry {
+ public:
+  typedef std::function<void(const WarmupReport&)> ReportCallback;
+
+  StatementRegistry() : _run_selects(false) {}
+
+  static StatementRegistry& instance() {
+    static StatementRegistry registry;
+    return registry;
+  }
+
+  // false, leaving the registry unchanged, if name is already registered
+  bool add(const std::string& name, SqlModel& model) {
+    Entry entry;
+    entry.name = name;
+    entry.sql = model.str();
+    entry.bindings = model.bindings().size();
+    entry.select = dynamic_cast<SelectModel*>(&model) != nullptr;
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto const& it : _entries) {
+      if (it.name == name) {
+        return false;
+      }
+    }
+    _entries.push_back(entry);
+    return true;
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _entries.size();
+  }
+
+  // also run every select once with null bindings, an empty key, to pull the
+  // pages it touches into the cache; writes are only ever prepared
+  StatementRegistry& run_selects(bool var) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _run_selects = var;
+    return *this;
+  }
+
+  StatementRegistry& on_warm_up(const ReportCallback& callback) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _callback = callback;
+    return *this;
+  }
+
+  // open a connection and warm it up, reporting through on_warm_up()
+  bool open(QSqlDatabase& db) {
+    if (!db.open()) {
+      return false;
+    }
+    WarmupReport report = warm_up(db);
+    ReportCallback callback;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      callback = _callback;
+    }
+    if (callback) {
+      callback(report);
+    }
+    return true;
+  }
+
+  // prepares every shape on db, keeping the statements for query()
+  WarmupReport warm_up(const QSqlDatabase& db) {
+    std::vector<Entry> entries;
+    bool run_selects;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      entries = _entries;
+      run_selects = _run_selects;
+    }
+
+    WarmupReport report;
+    report.connection = db.connectionName();
+    auto start = std::chrono::steady_clock::now();
+
+    std::unordered_map<std::string, QSqlQuery> prepared;
+    for (auto const& entry : entries) {
+      QSqlQuery query(db);
+      if (!query.prepare(entry.sql.c_str())) {
+        report.failures.push_back(
+            std::make_pair(entry.name, query.lastError().text()));
+        continue;
+      }
+      ++report.prepared;
+      prepared.emplace(entry.name, query);
+
+      if (run_selects && entry.select) {
+        for (int i = 0; i < entry.bindings; ++i) {
+          query.addBindValue(QVariant());
+        }
+        if (!query.exec()) {
+          report.failures.push_back(
+              std::make_pair(entry.name, query.lastError().text()));
+          continue;
+        }
+        while (query.next()) {
+        }
+        // release the result, keeping the statement
+        query.finish();
+        ++report.executed;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _prepared[db.connectionName()] = prepared;
+    }
+
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    report.elapsed_ms = elapsed.count();
+    return report;
+  }
+
+  //
+  // The statement for the named shape on db, as prepared by warm_up(), or
+  // prepared now and kept if the connection was not warmed up. For an
+  // unknown name the query is not prepared and fails to execute.
+  //
+  // QSqlQuery is implicitly shared, so every call for a name on one
+  // connection returns a handle to the same statement, and executing it
+  // replaces the result of every other handle. Keep one live handle per
+  // shape and connection: read its rows, or finish() it, before the shape is
+  // executed again.
+  //
+  QSqlQuery query(const QSqlDatabase& db, const std::string& name) {
+    std::string sql;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto connection = _prepared.find(db.connectionName());
+      if (connection != _prepared.end()) {
+        auto it = connection->second.find(name);
+        if (it != connection->second.end()) {
+          return it->second;
+        }
+      }
+      for (auto const& entry : _entries) {
+        if (entry.name == name) {
+          sql = entry.sql;
+          break;
+        }
+      }
+    }
+
+    QSqlQuery query(db);
+    if (!sql.empty() && query.prepare(sql.c_str())) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _prepared[db.connectionName()].emplace(name, query);
+    }
+    return query;
+  }
+
+  // drop the statements kept for db
+  void release(const QSqlDatabase& db) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _prepared.erase(db.connectionName());
+  }
+
+ private:
+  StatementRegistry(const StatementRegistry&) = delete;
+  StatementRegistry& operator=(const StatementRegistry&) = delete;
+
+  struct Entry {
+    std::string name;
+    std::string sql;
+    int bindings;
+    bool select;
+  };
+
+  mutable std::mutex _mutex;
+  std::vector<Entry> _entries;
+  bool _run_selects;
+  ReportCallback _callback;
+  // by connection name and shape name
+  std::map<QString, std::unordered_map<std::string, QSqlQuery>> _prepared;
+};
+
+}  // namespace sql_builder
@@ -0,0 +1,569 @@
+/**
+ * Scatter-gather execution of models over databases split by a shard key.
+ *
+ * Every shard gets a worker thread owning its own connection, as Qt requires
+ * a connection to be used only from the thread that created it. Models that
+ * pin the shard key to one value (an equality in the where clause, or the
+ * inserted value) run on that shard only. Other selects run on every shard
+ * in parallel and their rows are merged according to order_by, distinct,
+ * limit and offset; count, sum, min and max without group_by are combined.
+ */
+#pragma once
+
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QStringList>
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "sql.h"
+
+namespace sql_builder {
+
+struct ShardedResult {
+  QString error;
+  QStringList columns;
+  std::vector<QVariantList> rows;
+  // rows changed by writes, summed over the shards they ran on
+  int affected = 0;
+};
+
+//
+// One connection and the thread it lives on.
+//
+class ShardWorker {
+ public:
+  ShardWorker(const QString& driver, const QString& database,
+              const QString& connection)
+      : _stop(false) {
+    _thread = std::thread([this, driver, database, connection] {
+      run(driver, database, connection);
+    });
+  }
+
+  ~ShardWorker() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+  }
+
+  std::future<ShardedResult> submit(const std::string& sql,
+                                    const QVariantList& bindings) {
+    Job job;
+    job.sql = sql;
+    job.bindings = bindings;
+    std::future<ShardedResult> reply = job.reply.get_future();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _jobs.push_back(std::move(job));
+    }
+    _wake.notify_one();
+    return reply;
+  }
+
+ private:
+  ShardWorker(const ShardWorker&) = delete;
+  ShardWorker& operator=(const ShardWorker&) = delete;
+
+  struct Job {
+    std::string sql;
+    QVariantList bindings;
+    std::promise<ShardedResult> reply;
+  };
+
+  void run(const QString& driver, const QString& database,
+           const QString& connection) {
+    {
+      QSqlDatabase db = QSqlDatabase::addDatabase(driver, connection);
+      db.setDatabaseName(database);
+      bool open = db.open();
+
+      while (true) {
+        Job job;
+        {
+          std::unique_lock<std::mutex> lock(_mutex);
+          _wake.wait(lock, [this] { return _stop || !_jobs.empty(); });
+          if (_jobs.empty()) {
+            break;
+          }
+          job = std::move(_jobs.front());
+          _jobs.pop_front();
+        }
+
+        ShardedResult result;
+        if (!open) {
+          result.error = db.lastError().text();
+        } else {
+          execute(db, job, result);
+        }
+        job.reply.set_value(std::move(result));
+      }
+      db.close();
+    }
+    QSqlDatabase::removeDatabase(connection);
+  }
+
+  static void execute(QSqlDatabase& db, const Job& job,
+                      ShardedResult& result) {
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    if (!query.prepare(job.sql.c_str())) {
+      result.error = query.lastError().text();
+      return;
+    }
+    for (auto const& it : job.bindings) {
+      query.addBindValue(it);
+    }
+    if (!query.exec()) {
+      result.error = query.lastError().text();
+      return;
+    }
+
+    if (!query.isSelect()) {
+      result.affected = query.numRowsAffected();
+      return;
+    }
+    QSqlRecord record = query.record();
+    for (int i = 0; i < record.count(); ++i) {
+      result.columns.append(record.fieldName(i));
+    }
+    while (query.next()) {
+      QVariantList row;
+      for (int i = 0; i < record.count(); ++i) {
+        row.append(query.value(i));
+      }
+      result.rows.push_back(row);
+    }
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::deque<Job> _jobs;
+  bool _stop;
+  std::thread _thread;
+};
+
+//
+// Ordering used when merging rows from several shards: nulls first, numbers
+// numerically, byte arrays bytewise and everything else as strings.
+//
+inline int compare_values(const QVariant& a, const QVariant& b) {
+  if (a.isNull() || b.isNull()) {
+    return a.isNull() == b.isNull() ? 0 : (a.isNull() ? -1 : 1);
+  }
+
+  auto integral = [](int type) {
+    return type == QMetaType::Int || type == QMetaType::UInt ||
+           type == QMetaType::LongLong || type == QMetaType::ULongLong ||
+           type == QMetaType::Long || type == QMetaType::ULong ||
+           type == QMetaType::Short || type == QMetaType::UShort ||
+           type == QMetaType::Char || type == QMetaType::UChar ||
+           type == QMetaType::SChar || type == QMetaType::Bool;
+  };
+  auto real = [](int type) {
+    return type == QMetaType::Double || type == QMetaType::Float;
+  };
+  int ta = a.userType();
+  int tb = b.userType();
+
+  if (integral(ta) && integral(tb)) {
+    qlonglong x = a.toLongLong();
+    qlonglong y = b.toLongLong();
+    return x < y ? -1 : (x > y ? 1 : 0);
+  }
+  if ((integral(ta) || real(ta)) && (integral(tb) || real(tb))) {
+    double x = a.toDouble();
+    double y = b.toDouble();
+    return x < y ? -1 : (x > y ? 1 : 0);
+  }
+  if (ta == QMetaType::QByteArray && tb == QMetaType::QByteArray) {
+    QByteArray x = a.toByteArray();
+    QByteArray y = b.toByteArray();
+    int n = std::memcmp(x.constData(), y.constData(),
+                        std::min(x.size(), y.size()));
+    if (n != 0) {
+      return n < 0 ? -1 : 1;
+    }
+    return x.size() < y.size() ? -1 : (x.size() > y.size() ? 1 : 0);
+  }
+  int n = QString::compare(a.toString(), b.toString());
+  return n < 0 ? -1 : (n > 0 ? 1 : 0);
+}
+
+//
+// Runs models over a set of shards:
+//
+//   ShardedExecutor shards("user_id", {"users-0.db", "users-1.db"},
+//                          [](const QVariant& key) {
+//                            quint64 k = key.toLongLong();
+//                            return k % 2;
+//                          });
+//   ShardedResult result;
+//   shards.exec(model, result);
+//
+// Writes that pin the key run on one shard. Updates and deletes that do not
+// run on every shard, each shard committing on its own; inserts must carry
+// the key, and updates may not change it. A router answer that is not a shard
+// fails the execution. exec() may be called from several threads at once.
+//
+class ShardedExecutor {
+ public:
+  typedef std::function<size_t(const QVariant& key)> Router;
+
+  ShardedExecutor(const Identifier& key_column, const QStringList& databases,
+                  const Router& router, const QString& driver = "QSQLITE")
+      : _key(key_column), _router(router) {
+    QString prefix = QString("sql_builder_shard_%1_")
+                         .arg(reinterpret_cast<quintptr>(this));
+    for (int i = 0; i < databases.size(); ++i) {
+      _workers.emplace_back(new ShardWorker(driver, databases.at(i),
+                                            prefix + QString::number(i)));
+    }
+  }
+
+  size_t shards() const { return _workers.size(); }
+
+  enum { UNPINNED = -1, OUT_OF_RANGE = -2 };
+
+  // the shard a model is pinned to by its key, UNPINNED when it is not, or
+  // OUT_OF_RANGE when the router's answer is not a shard
+  int route(const SqlModel& model) const {
+    size_t routed;
+    return route(model, routed);
+  }
+
+  bool exec(SqlModel& model, ShardedResult& result) {
+    result = ShardedResult();
+    auto update = dynamic_cast<UpdateModel*>(&model);
+    if (update && update->sets(_key)) {
+      // the row would stay on the shard of its old key
+      result.error = "update of the shard key";
+      return false;
+    }
+
+    size_t routed;
+    int shard = route(model, routed);
+    if (shard == OUT_OF_RANGE) {
+      result.error = QString("router returned shard %1 of %2")
+                         .arg(static_cast<qulonglong>(routed))
+                         .arg(static_cast<qulonglong>(_workers.size()));
+      return false;
+    }
+    if (shard >= 0) {
+      result = _workers[shard]->submit(model.str(), model.bindings()).get();
+      return result.error.isEmpty();
+    }
+
+    auto select = dynamic_cast<SelectModel*>(&model);
+    if (dynamic_cast<InsertModel*>(&model)) {
+      result.error = "insert without a value for the shard key";
+      return false;
+    }
+
+    std::string sql;
+    if (select) {
+      if (!scatter_sql(*select, sql, result.error)) {
+        return false;
+      }
+    } else {
+      sql = model.str();
+    }
+
+    QVariantList bindings = model.bindings();
+    std::vector<std::future<ShardedResult>> pending;
+    for (auto const& worker : _workers) {
+      pending.push_back(worker->submit(sql, bindings));
+    }
+    std::vector<ShardedResult> replies;
+    for (auto& it : pending) {
+      replies.push_back(it.get());
+      if (!replies.back().error.isEmpty() && result.error.isEmpty()) {
+        result.error = replies.back().error;
+      }
+    }
+    if (!result.error.isEmpty()) {
+      return false;
+    }
+
+    if (!select) {
+      for (auto const& it : replies) {
+        result.affected += it.affected;
+      }
+      return true;
+    }
+    return gather(*select, replies, result);
+  }
+
+ private:
+  ShardedExecutor(const ShardedExecutor&) = delete;
+  ShardedExecutor& operator=(const ShardedExecutor&) = delete;
+
+  int route(const SqlModel& model, size_t& routed) const {
+    QVariant key;
+    if (!model.equality(_key, key)) {
+      return UNPINNED;
+    }
+    // checked before narrowing, so that (size_t) -1 or a huge value is not
+    // taken for UNPINNED or a valid shard
+    routed = _router(key);
+    if (routed >= _workers.size()) {
+      return OUT_OF_RANGE;
+    }
+    return static_cast<int>(routed);
+  }
+
+  enum Aggregate { NONE, COUNT, SUM, MIN, MAX, UNMERGEABLE };
+
+  // how a column's per-shard values combine; anything is_aggregate() finds
+  // that cannot be folded from one value per shard is UNMERGEABLE
+  static Aggregate aggregate_of(const Identifier& column) {
+    AggregateCall call;
+    if (!aggregate_call(column, call)) {
+      return NONE;
+    }
+    bool min_max = call.function == "min" || call.function == "max";
+    if (!call.whole || (call.distinct && !min_max)) {
+      return UNMERGEABLE;
+    }
+    if (call.function == "count") {
+      return COUNT;
+    }
+    if (call.function == "sum" || call.function == "total") {
+      return SUM;
+    }
+    if (call.function == "min") {
+      return MIN;
+    }
+    if (call.function == "max") {
+      return MAX;
+    }
+    return UNMERGEABLE;
+  }
+
+  static bool has_aggregate(const SelectModel& model) {
+    for (auto const& it : model._select_columns) {
+      if (aggregate_of(it) != NONE) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // the statement each shard runs for a select that is not pinned
+  static bool scatter_sql(SelectModel& model, std::string& sql,
+                          QString& error) {
+    if (!model._groupby_columns.empty()) {
+      error = "group by cannot be merged across shards";
+      return false;
+    }
+    if (!model._from_subquery.empty()) {
+      // e.g. a count() of a distinct query, which would count rows found on
+      // several shards more than once
+      error = "derived tables cannot be merged across shards";
+      return false;
+    }
+    for (auto const& it : model._select_columns) {
+      if (aggregate_of(it) == UNMERGEABLE) {
+        error = QString("%1 cannot be merged across shards")
+                    .arg(it.str().c_str());
+        return false;
+      }
+    }
+    // offset applies to the merged rows only, and every shard returns
+    // enough rows to cover it
+    long long limit, offset;
+    paging(model, limit, offset);
+    std::string saved_limit = model._limit;
+    std::string saved_offset = model._offset;
+    model._offset.clear();
+    if (limit < 0 || has_aggregate(model) ||
+        static_cast<unsigned long long>(limit) + offset > LLONG_MAX) {
+      model._limit.clear();
+    } else {
+      model._limit = std::to_string(limit + offset);
+    }
+    sql = model.str();
+    model._limit = saved_limit;
+    model._offset = saved_offset;
+    return true;
+  }
+
+  // limit and offset as numbers; a negative limit, as for sqlite, or none at
+  // all is -1, and a negative offset is 0
+  static void paging(const SelectModel& model, long long& limit,
+                     long long& offset) {
+    limit = model._limit.empty() ? -1 : std::stoll(model._limit);
+    offset = model._offset.empty() ? 0 : std::stoll(model._offset);
+    if (limit < 0) {
+      limit = -1;
+    }
+    if (offset < 0) {
+      offset = 0;
+    }
+  }
+
+  static bool gather(const SelectModel& model,
+                     std::vector<ShardedResult>& replies,
+                     ShardedResult& result) {
+    result.columns = replies.front().columns;
+
+    if (has_aggregate(model)) {
+      // one row per shard, folded column by column
+      QVariantList merged;
+      for (int i = 0; i < result.columns.size(); ++i) {
+        Aggregate kind =
+            i < static_cast<int>(model._select_columns.size())
+                ? aggregate_of(model._select_columns[i])
+                : NONE;
+        QVariant value;
+        for (auto const& reply : replies) {
+          if (reply.rows.empty()) {
+            continue;
+          }
+          value = fold(kind, value, reply.rows.front().at(i));
+        }
+        merged.append(value);
+      }
+      result.rows.push_back(merged);
+      page(model, result);
+      return true;
+    }
+
+    for (auto& reply : replies) {
+      result.rows.insert(result.rows.end(), reply.rows.begin(),
+                         reply.rows.end());
+    }
+
+    if (!model._order_by.empty()) {
+      std::vector<std::pair<int, bool>> keys;
+      if (!order_keys(model._order_by, result.columns, keys, result.error)) {
+        return false;
+      }
+      std::stable_sort(result.rows.begin(), result.rows.end(),
+                       [&keys](const QVariantList& a, const QVariantList& b) {
+                         for (auto const& key : keys) {
+                           int n = compare_values(a.at(key.first),
+                                                  b.at(key.first));
+                           if (n != 0) {
+                             return key.second ? n > 0 : n < 0;
+                           }
+                         }
+                         return false;
+                       });
+    }
+
+    if (model._distinct) {
+      std::unordered_set<std::string> seen;
+      std::vector<QVariantList> unique;
+      for (auto& row : result.rows) {
+        std::string key;
+        for (auto const& value : row) {
+          key.append(std::to_string(value.userType()));
+          key.push_back(':');
+          key.append(value.isNull() ? std::string()
+                                    : value.toString().toStdString());
+          key.push_back('\0');
+        }
+        if (seen.insert(key).second) {
+          unique.push_back(row);
+        }
+      }
+      result.rows.swap(unique);
+    }
+
+    page(model, result);
+    return true;
+  }
+
+  // the merged rows the model's offset and limit select
+  static void page(const SelectModel& model, ShardedResult& result) {
+    long long limit, offset;
+    paging(model, limit, offset);
+    if (offset > 0) {
+      result.rows.erase(result.rows.begin(),
+                        result.rows.begin() +
+                            std::min(static_cast<size_t>(offset),
+                                     result.rows.size()));
+    }
+    if (limit >= 0 && result.rows.size() > static_cast<size_t>(limit)) {
+      result.rows.resize(limit);
+    }
+  }
+
+  static QVariant fold(Aggregate kind, const QVariant& acc,
+                       const QVariant& value) {
+    if (value.isNull()) {
+      return acc;
+    }
+    if (acc.isNull()) {
+      return value;
+    }
+    switch (kind) {
+      case COUNT:
+      case SUM:
+        if (acc.userType() == QMetaType::Double ||
+            value.userType() == QMetaType::Double) {
+          return acc.toDouble() + value.toDouble();
+        }
+        return acc.toLongLong() + value.toLongLong();
+      case MIN:
+        return compare_values(value, acc) < 0 ? value : acc;
+      case MAX:
+        return compare_values(value, acc) > 0 ? value : acc;
+      default:
+        return acc;
+    }
+  }
+
+  // result column and descending flag for each order by term
+  static bool order_keys(const std::string& order_by,
+                         const QStringList& columns,
+                         std::vector<std::pair<int, bool>>& keys,
+                         QString& error) {
+    for (auto const& term : order_by_terms(order_by)) {
+      std::string name = term.first;
+      size_t dot = name.rfind('.');
+      if (dot != std::string::npos) {
+        name = name.substr(dot + 1);
+      }
+
+      int index = -1;
+      for (int i = 0; i < columns.size(); ++i) {
+        if (columns.at(i).toStdString() == name) {
+          index = i;
+          break;
+        }
+      }
+      if (index < 0) {
+        error = QString("order by %1 is not a selected column")
+                    .arg(name.c_str());
+        return false;
+      }
+      keys.push_back(std::make_pair(index, term.second));
+    }
+    return true;
+  }
+
+  Identifier _key;
+  Router _router;
+  std::vector<std::unique_ptr<ShardWorker>> _workers;
+};
+
+}  // namespace sql_builder
@@ -0,0 +1,264 @@
+/**
+ * Per query shape execution statistics, with optional capture of the query
+ * plan the first time each shape runs.
+ *
+ * A shape is the sql text of a model with its placeholders, so every
+ * execution of e.g. `select id from user where age > ?` counts towards the
+ * same shape whatever the bound values are. Literals in the text count as
+ * placeholders too, so statements rendered with inline_literals() do not
+ * each make a new shape.
+ */
+#pragma once
+
+#include <QSqlDriver>
+#include <QSqlField>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "sql.h"
+
+namespace sql_builder {
+
+struct ShapeStats {
+  // with literals replaced by `?`, see literal_shape()
+  std::string sql;
+  unsigned long long executions = 0;
+  unsigned long long failures = 0;
+  double total_ms = 0;
+  double max_ms = 0;
+
+  // one entry per row of the plan, empty until captured
+  std::vector<std::string> plan;
+  // the plan reads a whole table
+  bool full_scan = false;
+  // the plan sorts or groups through a temporary structure (a temp b-tree in
+  // sqlite, a sort node in postgres, temporary/filesort in mysql)
+  bool temp_sort = false;
+};
+
+//
+// Replace each `?` outside quotes with the driver's literal for the
+// matching binding. Used for postgres, which cannot prepare an explain.
+//
+inline std::string inline_bindings(const std::string& sql,
+                                   const QVariantList& bindings,
+                                   const QSqlDriver* driver) {
+  std::string result;
+  int n = 0;
+  char quote = 0;
+  for (char c : sql) {
+    if (quote) {
+      if (c == quote) {
+        quote = 0;
+      }
+      result.push_back(c);
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      result.push_back(c);
+    } else if (c == '?' && n < bindings.size()) {
+      QVariant const& value = bindings.at(n++);
+      QSqlField field(QString(), value.type());
+      field.setValue(value);
+      result.append(driver->formatValue(field).toStdString());
+    } else {
+      result.push_back(c);
+    }
+  }
+  return result;
+}
+
+//
+// A QueryObserver that keeps a ShapeStats per shape:
+//
+//   QueryStats stats;
+//   stats.capture_plans(true);
+//   stats.on_plan_warning([](const ShapeStats& shape) {
+//     std::cerr << "slow plan for " << shape.sql << std::endl;
+//   });
+//   add_observer(&stats);
+//
+// With plan capture on, the first successful execution of a shape is followed by
+// `explain query plan` (sqlite) or `explain` (postgres, mysql) of the same
+// statement with the same bindings, on the same connection. Plans with a full
+// scan or a temporary sort are passed to the warning callback.
+//
+class QueryStats : public QueryObserver {
+ public:
+  typedef std::function<void(const ShapeStats&)> PlanCallback;
+
+  QueryStats() {}
+  virtual ~QueryStats() {}
+
+  QueryStats& capture_plans(bool var) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _capture_plans = var;
+    return *this;
+  }
+
+  QueryStats& on_plan_warning(const PlanCallback& callback) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _callback = callback;
+    return *this;
+  }
+
+  void executed(SqlModel& model, QSqlQuery& query, bool ok,
+                double elapsed_ms) override {
+    std::string sql = literal_shape(model.last_sql());
+    bool capture;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto inserted = _shapes.emplace(sql, ShapeStats());
+      ShapeStats& shape = inserted.first->second;
+      if (inserted.second) {
+        shape.sql = sql;
+      }
+      ++shape.executions;
+      if (!ok) {
+        ++shape.failures;
+      }
+      shape.total_ms += elapsed_ms;
+      if (elapsed_ms > shape.max_ms) {
+        shape.max_ms = elapsed_ms;
+      }
+      capture = _capture_plans && ok && _planned.insert(sql).second;
+    }
+
+    if (capture) {
+      capture_plan(model, query, sql);
+    }
+  }
+
+  // the stats of the shape of sql, which may hold placeholders or literals
+  bool find(const std::string& sql, ShapeStats& shape) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _shapes.find(literal_shape(sql));
+    if (it == _shapes.end()) {
+      return false;
+    }
+    shape = it->second;
+    return true;
+  }
+
+  std::vector<ShapeStats> shapes() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<ShapeStats> result;
+    result.reserve(_shapes.size());
+    for (auto const& it : _shapes) {
+      result.push_back(it.second);
+    }
+    return result;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _shapes.clear();
+    _planned.clear();
+  }
+
+ private:
+  // explain the statement the model just ran, storing the plan with shape
+  void capture_plan(SqlModel& model, QSqlQuery& query,
+                    const std::string& shape_sql) {
+    const QSqlDriver* driver = query.driver();
+    if (!driver) {
+      return;
+    }
+    auto dbms = driver->dbmsType();
+    std::string const& sql = model.last_sql();
+
+    // a second result on the connection the model just ran on
+    QSqlQuery explain(driver->createResult());
+    bool ok;
+    if (dbms == QSqlDriver::SQLite || dbms == QSqlDriver::MySqlServer) {
+      std::string text(dbms == QSqlDriver::SQLite ? "explain query plan "
+                                                  : "explain ");
+      text.append(sql);
+      ok = explain.prepare(text.c_str());
+      if (ok) {
+        for (auto const& it : model.bindings()) {
+          explain.addBindValue(it);
+        }
+        ok = explain.exec();
+      }
+    } else if (dbms == QSqlDriver::PostgreSQL) {
+      std::string text("explain ");
+      text.append(inline_bindings(sql, model.bindings(), driver));
+      ok = explain.exec(text.c_str());
+    } else {
+      return;
+    }
+    if (!ok) {
+      return;
+    }
+
+    std::vector<std::string> plan;
+    while (explain.next()) {
+      if (dbms == QSqlDriver::SQLite) {
+        // id, parent, notused, detail
+        plan.push_back(explain.value(3).toString().toStdString());
+      } else if (dbms == QSqlDriver::PostgreSQL) {
+        plan.push_back(explain.value(0).toString().toStdString());
+      } else {
+        QSqlRecord record = explain.record();
+        std::string row;
+        for (int i = 0; i < record.count(); ++i) {
+          if (i > 0) {
+            row.append("; ");
+          }
+          row.append(record.fieldName(i).toStdString());
+          row.append("=");
+          row.append(record.value(i).toString().toStdString());
+        }
+        plan.push_back(row);
+      }
+    }
+
+    bool full_scan = false;
+    bool temp_sort = false;
+    for (auto const& line : plan) {
+      if (dbms == QSqlDriver::SQLite) {
+        full_scan |= line.compare(0, 5, "SCAN ") == 0 &&
+                     line.find(" USING ") == std::string::npos &&
+                     line != "SCAN CONSTANT ROW";
+        temp_sort |= line.find("USE TEMP B-TREE") != std::string::npos;
+      } else if (dbms == QSqlDriver::PostgreSQL) {
+        full_scan |= line.find("Seq Scan") != std::string::npos;
+        temp_sort |= line.find("Sort  (") != std::string::npos;
+      } else {
+        full_scan |= line.find("type=ALL;") != std::string::npos;
+        temp_sort |= line.find("Using temporary") != std::string::npos ||
+                     line.find("Using filesort") != std::string::npos;
+      }
+    }
+
+    ShapeStats shape;
+    PlanCallback callback;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      ShapeStats& stored = _shapes[shape_sql];
+      stored.plan = plan;
+      stored.full_scan = full_scan;
+      stored.temp_sort = temp_sort;
+      shape = stored;
+      callback = _callback;
+    }
+    if ((full_scan || temp_sort) && callback) {
+      callback(shape);
+    }
+  }
+
+  mutable std::mutex _mutex;
+  std::unordered_map<std::string, ShapeStats> _shapes;
+  // shapes whose plan has been captured, or is being captured
+  std::unordered_set<std::string> _planned;
+  bool _capture_plans = false;
+  PlanCallback _callback;
+};
+
+}  // namespace sql_builder
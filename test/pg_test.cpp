@@ -0,0 +1,179 @@
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+
+#include "sql_pg.h"
+
+using namespace sql_builder;
+
+int main(int argc, char** argv) {
+  assert(pg::number_placeholders("update user set name = ?, age = ? where id in (?, ?)")
+             == "update user set name = $1, age = $2 where id in ($3, $4)");
+  assert(pg::number_placeholders("select id from user where name = 'why?' and age > ?")
+             == "select id from user where name = 'why?' and age > $1");
+  assert(pg::number_placeholders("select \"a?\" from user where x = 'it''s?' and y = ?")
+             == "select \"a?\" from user where x = 'it''s?' and y = $1");
+
+  if (argc < 2) {
+    std::cerr << "usage: sql-pg-test <conninfo>" << std::endl;
+    return 1;
+  }
+
+  pg::Connection conn(argv[1]);
+  if (!conn.is_open()) {
+    std::cerr << conn.last_error() << std::endl;
+    return 1;
+  }
+
+  pg::Result created(PQexec(conn.handle(),
+      "create table user_score (id int primary key, name text, score float8, data bytea, active bool)"));
+  assert(created.ok());
+
+  // pipelined inserts, nothing is read back until after the sync
+  assert(conn.begin_pipeline());
+  InsertModel i;
+  for (int n = 0; n < 100; ++n) {
+    i.reset()
+        .insert("id", n)
+        ("name", std::string("user") + std::to_string(n))
+        ("score", n * 1.5)
+        ("data", QByteArray("\0\1\2", 3))
+        ("active", n % 2 == 0)
+        .into("user_score");
+    assert(conn.send(i));
+  }
+
+  UpdateModel u;
+  u.update("user_score").set("name", "renamed").where(Column("id") < 10);
+  assert(conn.send(u));
+
+  assert(conn.sync());
+  assert(conn.pending() == 101);
+  for (int n = 0; n < 100; ++n) {
+    pg::Result r = conn.next_result();
+    assert(r.ok());
+    assert(r.affected() == 1);
+  }
+  pg::Result updated = conn.next_result();
+  assert(updated.ok());
+  assert(updated.affected() == 10);
+  assert(conn.pending() == 0);
+  assert(conn.end_pipeline());
+
+  // binary results
+  SelectModel s;
+  s.select("id", "name", "score", "data", "active")
+      .from("user_score")
+      .where(Column("id") == 4);
+  pg::Result row = conn.exec(s);
+  assert(row.ok());
+  assert(row.rows() == 1);
+  assert(row.value(0, 0).toInt() == 4);
+  assert(row.value(0, 1).toString() == "renamed");
+  assert(row.value(0, 2).toDouble() == 6.0);
+  assert(row.value(0, 3).toByteArray() == QByteArray("\0\1\2", 3));
+  assert(row.value(0, 4).toBool());
+
+  // types without a simple binary form
+  SelectModel typed;
+  typed.select("12345.678::numeric", "(-0.5)::numeric", "date '2024-02-29'",
+               "timestamptz '2024-02-29 12:34:56.789+00'", "timestamp '1999-12-31 23:59:59'",
+               "'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid", "'{\"a\": 1}'::jsonb")
+      .from("user_score")
+      .where(Column("id") == 4);
+  pg::Result decoded = conn.exec(typed);
+  assert(decoded.ok() && decoded.rows() == 1);
+  assert(decoded.value(0, 0).toString() == "12345.678");
+  assert(decoded.value(0, 1).toString() == "-0.5");
+  assert(decoded.value(0, 2).toDate() == QDate(2024, 2, 29));
+  assert(decoded.value(0, 3).toDateTime() ==
+         QDateTime(QDate(2024, 2, 29), QTime(12, 34, 56, 789), Qt::UTC));
+  assert(decoded.value(0, 4).toDateTime() == QDateTime(QDate(1999, 12, 31), QTime(23, 59, 59)));
+  assert(decoded.value(0, 5).toString() == "a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11");
+  assert(decoded.value(0, 6).toString() == "{\"a\": 1}");
+
+  // date times are sent with their offset, whatever their time spec
+  QDateTime utc(QDate(2024, 2, 29), QTime(10, 34, 56, 789), Qt::UTC);
+  QDateTime times[] = {utc, utc.toLocalTime(),
+                       QDateTime(QDate(2024, 2, 29), QTime(12, 34, 56, 789), Qt::OffsetFromUTC, 7200)};
+  for (auto const& time : times) {
+    SelectModel at;
+    at.select("id")
+        .from("user_score")
+        .where(Column("id") == 4)
+        .where(Column("timestamptz '2024-02-29 10:34:56.789+00'") == time);
+    pg::Result same = conn.exec(at);
+    assert(same.ok() && same.rows() == 1);
+  }
+
+  SelectModel c;
+  c.select("count(*)").from("user_score").where(Column("name") != "renamed");
+  pg::Result count = conn.exec(c);
+  assert(count.ok());
+  assert(count.value(0, 0).toLongLong() == 90);
+
+  // a failing statement aborts the rest of its pipeline segment only
+  assert(conn.begin_pipeline());
+  DeleteModel d;
+  d._delete().from("missing_table").where(Column("id") == 1);
+  assert(conn.send(d));
+  d.reset();
+  d._delete().from("user_score").where(Column("id") == 1);
+  assert(conn.send(d));
+  assert(conn.sync());
+  assert(conn.next_result().status() == PGRES_FATAL_ERROR);
+  assert(conn.next_result().status() == PGRES_PIPELINE_ABORTED);
+  assert(conn.send(d));
+  assert(conn.sync());
+  // ending the pipeline early consumes nothing
+  assert(!conn.end_pipeline());
+  assert(conn.pending() == 1);
+  assert(conn.next_result().affected() == 1);
+  assert(conn.end_pipeline());
+
+  // a failed prepare does not free its statement name for reuse
+  assert(conn.begin_pipeline());
+  SelectModel bad, good, next;
+  bad.select("id").from("missing_table").where(Column("id") == 2);
+  good.select("name").from("user_score").where(Column("id") == 2);
+  next.select("score").from("user_score").where(Column("id") == 2);
+  assert(conn.send(bad));
+  assert(conn.sync());
+  assert(conn.send(good));
+  assert(conn.sync());
+  assert(conn.next_result().status() == PGRES_FATAL_ERROR);
+  assert(conn.next_result().ok());
+  assert(conn.send(next));
+  assert(conn.sync());
+  assert(conn.next_result().ok());
+  assert(conn.end_pipeline());
+
+  // statements with inlined literals do not pile up on the server
+  pg::Connection small(argv[1], 2);
+  assert(small.is_open());
+  auto prepared = [&small]() {
+    pg::Result r(PQexec(small.handle(), "select count(*) from pg_prepared_statements"));
+    return std::atoi(PQgetvalue(r.handle(), 0, 0));
+  };
+  for (int n = 0; n < 5; ++n) {
+    SelectModel one;
+    one.select("name").from("user_score").where(Column("id").inline_literals(true) == n);
+    assert(small.exec(one).ok());
+  }
+  assert(prepared() == 2);
+  assert(small.begin_pipeline());
+  for (int n = 5; n < 10; ++n) {
+    SelectModel one;
+    one.select("name").from("user_score").where(Column("id").inline_literals(true) == n);
+    assert(small.send(one));
+  }
+  assert(small.sync());
+  while (small.pending()) {
+    assert(small.next_result().ok());
+  }
+  assert(small.end_pipeline());
+  assert(prepared() == 2);
+
+  std::cout << "pg ok" << std::endl;
+  return 0;
+}
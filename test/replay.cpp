@@ -0,0 +1,635 @@
+//
+// sql-replay: replays a workload file against a sqlite database from several
+// threads and reports throughput, latency percentiles and busy retries per
+// statement shape.
+//
+//   sql-replay workload.json [--threads N] [--duration S] [--qps Q]
+//                            [--database FILE] [--inline-literals] [--csv]
+//
+// The workload format is described in README.md; workload.json is an example.
+//
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sql.h"
+
+using namespace sql_builder;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+[[noreturn]] void fail(const std::string& message) {
+  std::cerr << "sql-replay: " << message << std::endl;
+  std::exit(2);
+}
+
+//
+// Generates binding values:
+//
+//   {"dist": "constant", "value": 7}
+//   {"dist": "uniform", "min": 1, "max": 1000}
+//   {"dist": "zipf", "min": 1, "max": 1000, "s": 1.1}   min is the hottest
+//   {"dist": "real", "min": 0, "max": 1}
+//   {"dist": "string", "length": 12}
+//   {"dist": "choice", "values": ["a", "b", "c"]}
+//
+class Distribution {
+ public:
+  explicit Distribution(const QJsonValue& spec) : _min(0), _max(0), _length(0) {
+    if (!spec.isObject()) {
+      // a bare value is a constant
+      _kind = CONSTANT;
+      _value = spec.toVariant();
+      return;
+    }
+
+    QJsonObject object = spec.toObject();
+    QString dist = object.value("dist").toString("constant");
+    _min = object.value("min").toDouble(0);
+    _max = object.value("max").toDouble(_min);
+    if (_max < _min) {
+      fail("distribution max is below min");
+    }
+
+    if (dist == "constant") {
+      _kind = CONSTANT;
+      _value = object.value("value").toVariant();
+    } else if (dist == "uniform") {
+      _kind = UNIFORM;
+    } else if (dist == "zipf") {
+      _kind = ZIPF;
+      double s = object.value("s").toDouble(1.0);
+      qint64 n = static_cast<qint64>(_max) - static_cast<qint64>(_min) + 1;
+      if (n > 10000000) {
+        fail("zipf range is limited to 10000000 values");
+      }
+      _cdf.reserve(n);
+      double sum = 0;
+      for (qint64 k = 1; k <= n; ++k) {
+        sum += 1.0 / std::pow(static_cast<double>(k), s);
+        _cdf.push_back(sum);
+      }
+      for (auto& it : _cdf) {
+        it /= sum;
+      }
+    } else if (dist == "real") {
+      _kind = REAL;
+    } else if (dist == "string") {
+      _kind = STRING;
+      _length = object.value("length").toInt(8);
+    } else if (dist == "choice") {
+      _kind = CHOICE;
+      for (auto const& it : object.value("values").toArray()) {
+        _choices.push_back(it.toVariant());
+      }
+      if (_choices.empty()) {
+        fail("choice distribution without values");
+      }
+    } else {
+      fail("unknown distribution " + dist.toStdString());
+    }
+  }
+
+  QVariant next(std::mt19937_64& rng) const {
+    switch (_kind) {
+      case CONSTANT:
+        return _value;
+      case UNIFORM:
+        return std::uniform_int_distribution<qint64>(
+            static_cast<qint64>(_min), static_cast<qint64>(_max))(rng);
+      case ZIPF: {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        auto rank = std::lower_bound(_cdf.begin(), _cdf.end(), u) - _cdf.begin();
+        rank = std::min<qint64>(rank, _cdf.size() - 1);
+        return static_cast<qint64>(_min) + rank;
+      }
+      case REAL:
+        return std::uniform_real_distribution<double>(_min, _max)(rng);
+      case STRING: {
+        std::string s(_length, 'a');
+        std::uniform_int_distribution<int> letter(0, 25);
+        for (auto& c : s) {
+          c = static_cast<char>('a' + letter(rng));
+        }
+        return QString::fromStdString(s);
+      }
+      case CHOICE:
+        return _choices[std::uniform_int_distribution<size_t>(
+            0, _choices.size() - 1)(rng)];
+    }
+    return QVariant();
+  }
+
+ private:
+  enum Kind { CONSTANT, UNIFORM, ZIPF, REAL, STRING, CHOICE };
+
+  Kind _kind;
+  QVariant _value;
+  double _min;
+  double _max;
+  int _length;
+  std::vector<double> _cdf;
+  std::vector<QVariant> _choices;
+};
+
+struct Condition {
+  std::string column;
+  std::string op;
+  Distribution value;
+};
+
+//
+// One statement shape of the workload:
+//
+//   {"name": "user.by_age", "type": "select", "weight": 5, "table": "user",
+//    "columns": ["id", "name"], "order_by": "id", "limit": 10,
+//    "where": [{"column": "age", "op": ">=", "value": {...}}]}
+//
+// inserts take "values" and updates "set", objects of column to distribution.
+// Deletes and updates take "where" like selects.
+//
+struct Shape {
+  std::string name;
+  std::string type;
+  std::string table;
+  double weight;
+  std::vector<std::string> columns;
+  std::vector<std::pair<std::string, Distribution>> values;
+  std::vector<Condition> where;
+  std::string order_by;
+  int limit;
+
+  bool read() const { return type == "select"; }
+
+  // the statement for one operation, with its values drawn from rng; busy
+  // retries execute the same model again rather than drawing new values
+  std::unique_ptr<SqlModel> build(std::mt19937_64& rng,
+                                  bool inline_literals) const {
+    if (type == "select") {
+      std::unique_ptr<SelectModel> s(new SelectModel);
+      for (auto const& it : columns) {
+        s->select(it);
+      }
+      s->from(table);
+      for (auto const& it : where) {
+        s->where(condition(it, rng, inline_literals));
+      }
+      if (!order_by.empty()) {
+        s->order_by(order_by);
+      }
+      if (limit > 0) {
+        s->limit(limit);
+      }
+      return s;
+    }
+
+    if (type == "insert") {
+      std::unique_ptr<InsertModel> i(new InsertModel);
+      i->inline_literals(inline_literals);
+      for (auto const& it : values) {
+        i->insert(it.first, it.second.next(rng));
+      }
+      i->into(table);
+      return i;
+    }
+
+    if (type == "update") {
+      std::unique_ptr<UpdateModel> u(new UpdateModel);
+      u->update(table).inline_literals(inline_literals);
+      for (auto const& it : values) {
+        u->set(it.first, it.second.next(rng));
+      }
+      for (auto const& it : where) {
+        u->where(condition(it, rng, inline_literals));
+      }
+      return u;
+    }
+
+    std::unique_ptr<DeleteModel> d(new DeleteModel);
+    d->_delete().from(table);
+    for (auto const& it : where) {
+      d->where(condition(it, rng, inline_literals));
+    }
+    return d;
+  }
+
+  bool exec(SqlModel& model, QSqlQuery& query) const {
+    if (!model.exec(query)) {
+      return false;
+    }
+    if (read()) {
+      // fetching the rows is part of the cost
+      while (query.next()) {
+      }
+    }
+    return true;
+  }
+
+ private:
+  static Column condition(const Condition& it, std::mt19937_64& rng,
+                          bool inline_literals) {
+    Column c(it.column);
+    c.inline_literals(inline_literals);
+    QVariant v = it.value.next(rng);
+    if (it.op == "=") {
+      c == v;
+    } else if (it.op == "!=") {
+      c != v;
+    } else if (it.op == ">") {
+      c > v;
+    } else if (it.op == ">=") {
+      c >= v;
+    } else if (it.op == "<") {
+      c < v;
+    } else {
+      c <= v;
+    }
+    return c;
+  }
+};
+
+struct Workload {
+  QString database;
+  int threads;
+  double duration;
+  // total for all threads, 0 for as fast as possible
+  double qps;
+  // share of selects, below 0 to pick every shape by weight alone
+  double read_ratio;
+  int retries;
+  // render values as sql literals instead of binding them
+  bool inline_literals;
+  std::vector<std::string> setup;
+  std::vector<Shape> shapes;
+};
+
+Workload load(const QString& path) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    fail("cannot open " + path.toStdString());
+  }
+  QJsonParseError error;
+  QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &error);
+  if (!document.isObject()) {
+    fail(path.toStdString() + ": " + error.errorString().toStdString());
+  }
+  QJsonObject root = document.object();
+
+  Workload w;
+  w.database = root.value("database").toString("replay.db");
+  w.threads = root.value("threads").toInt(4);
+  w.duration = root.value("duration").toDouble(10);
+  w.qps = root.value("qps").toDouble(0);
+  w.read_ratio = root.value("read_ratio").toDouble(-1);
+  w.retries = root.value("retries").toInt(100);
+  w.inline_literals = root.value("inline_literals").toBool(false);
+  for (auto const& it : root.value("setup").toArray()) {
+    w.setup.push_back(it.toString().toStdString());
+  }
+
+  static const char* const types[] = {"select", "insert", "update", "delete"};
+  static const char* const ops[] = {"=", "!=", ">", ">=", "<", "<="};
+
+  for (auto const& value : root.value("shapes").toArray()) {
+    QJsonObject object = value.toObject();
+    Shape shape;
+    shape.type = object.value("type").toString("select").toStdString();
+    shape.table = object.value("table").toString().toStdString();
+    shape.name = object.value("name").toString().toStdString();
+    if (shape.name.empty()) {
+      shape.name = shape.type + " " + shape.table;
+    }
+    shape.weight = object.value("weight").toDouble(1);
+    shape.order_by = object.value("order_by").toString().toStdString();
+    shape.limit = object.value("limit").toInt(0);
+
+    if (std::find(std::begin(types), std::end(types), shape.type) ==
+        std::end(types)) {
+      fail(shape.name + ": unknown type " + shape.type);
+    }
+    if (shape.table.empty()) {
+      fail(shape.name + ": no table");
+    }
+
+    for (auto const& it : object.value("columns").toArray()) {
+      shape.columns.push_back(it.toString().toStdString());
+    }
+    if (shape.read() && shape.columns.empty()) {
+      shape.columns.push_back("*");
+    }
+
+    QJsonObject values = object.value(shape.type == "update" ? "set" : "values")
+                             .toObject();
+    for (auto it = values.begin(); it != values.end(); ++it) {
+      shape.values.push_back(
+          std::make_pair(it.key().toStdString(), Distribution(it.value())));
+    }
+    if ((shape.type == "insert" || shape.type == "update") &&
+        shape.values.empty()) {
+      fail(shape.name + ": nothing to write");
+    }
+
+    for (auto const& it : object.value("where").toArray()) {
+      QJsonObject where = it.toObject();
+      Condition c{where.value("column").toString().toStdString(),
+                  where.value("op").toString("=").toStdString(),
+                  Distribution(where.value("value"))};
+      if (std::find(std::begin(ops), std::end(ops), c.op) == std::end(ops)) {
+        fail(shape.name + ": unknown operator " + c.op);
+      }
+      shape.where.push_back(c);
+    }
+
+    w.shapes.push_back(shape);
+  }
+
+  if (w.shapes.empty()) {
+    fail("no shapes in " + path.toStdString());
+  }
+  return w;
+}
+
+struct ShapeResult {
+  std::vector<double> latencies_ms;
+  long errors = 0;
+  long busy_retries = 0;
+  std::string first_error;
+};
+
+struct ThreadResult {
+  std::vector<ShapeResult> shapes;
+  std::string error;
+};
+
+// sqlite reports a contended database or table as SQLITE_BUSY or SQLITE_LOCKED
+bool is_busy(const QSqlError& error) {
+  int code = error.nativeErrorCode().toInt() & 0xff;
+  return code == 5 || code == 6;
+}
+
+//
+// Picks shapes by weight, honouring the read ratio when there are both reads
+// and writes.
+//
+class Picker {
+ public:
+  explicit Picker(const Workload& w) : _read_ratio(w.read_ratio) {
+    std::vector<double> reads, writes, all;
+    for (size_t i = 0; i < w.shapes.size(); ++i) {
+      auto const& shape = w.shapes[i];
+      (shape.read() ? _reads : _writes).push_back(i);
+      (shape.read() ? reads : writes).push_back(shape.weight);
+      all.push_back(shape.weight);
+    }
+    _read = std::discrete_distribution<size_t>(reads.begin(), reads.end());
+    _write = std::discrete_distribution<size_t>(writes.begin(), writes.end());
+    _all = std::discrete_distribution<size_t>(all.begin(), all.end());
+  }
+
+  size_t next(std::mt19937_64& rng) {
+    if (_read_ratio < 0 || _reads.empty() || _writes.empty()) {
+      return _all(rng);
+    }
+    if (std::uniform_real_distribution<double>(0, 1)(rng) < _read_ratio) {
+      return _reads[_read(rng)];
+    }
+    return _writes[_write(rng)];
+  }
+
+ private:
+  double _read_ratio;
+  std::vector<size_t> _reads;
+  std::vector<size_t> _writes;
+  std::discrete_distribution<size_t> _read;
+  std::discrete_distribution<size_t> _write;
+  std::discrete_distribution<size_t> _all;
+};
+
+//
+// Each thread runs on its own connection. With a target rate, every statement
+// has an intended start time and latency is measured from it, so a stall
+// counts against the statements queued behind it too.
+//
+void replay(const Workload& w, int index, Clock::time_point start,
+            ThreadResult& result) {
+  result.shapes.resize(w.shapes.size());
+  QString name = QString("replay-%1").arg(index);
+  {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", name);
+    db.setDatabaseName(w.database);
+    // busy is retried here, so that it can be counted
+    db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=0");
+    if (!db.open()) {
+      result.error = db.lastError().text().toStdString();
+    } else {
+      std::mt19937_64 rng(index + 1);
+      Picker picker(w);
+      QSqlQuery query(db);
+
+      auto end = start + std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double>(w.duration));
+      std::chrono::duration<double> interval(w.qps > 0 ? w.threads / w.qps
+                                                       : 0);
+      // stagger the threads across one interval
+      auto offset = interval * (static_cast<double>(index) / w.threads);
+
+      for (long n = 0;; ++n) {
+        Clock::time_point intended = Clock::now();
+        if (w.qps > 0) {
+          intended = start + std::chrono::duration_cast<Clock::duration>(
+                                 offset + interval * static_cast<double>(n));
+          if (intended >= end) {
+            break;
+          }
+          std::this_thread::sleep_until(intended);
+        } else if (intended >= end) {
+          break;
+        }
+
+        size_t i = picker.next(rng);
+        ShapeResult& shape = result.shapes[i];
+        std::unique_ptr<SqlModel> model =
+            w.shapes[i].build(rng, w.inline_literals);
+        bool ok = false;
+        for (int attempt = 0;; ++attempt) {
+          ok = w.shapes[i].exec(*model, query);
+          if (ok || !is_busy(query.lastError()) || attempt == w.retries) {
+            break;
+          }
+          ++shape.busy_retries;
+          std::this_thread::sleep_for(
+              std::chrono::microseconds(std::min(100 << std::min(attempt, 7),
+                                                 10000)));
+        }
+
+        std::chrono::duration<double, std::milli> elapsed =
+            Clock::now() - intended;
+        shape.latencies_ms.push_back(elapsed.count());
+        if (!ok) {
+          if (shape.first_error.empty()) {
+            shape.first_error = query.lastError().text().toStdString();
+          }
+          ++shape.errors;
+        }
+      }
+    }
+  }
+  QSqlDatabase::removeDatabase(name);
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+  return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Replays a statement workload against sqlite.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("workload", "Workload file (json).");
+  QCommandLineOption threads_option("threads", "Override the thread count.", "n");
+  QCommandLineOption duration_option("duration", "Override the duration.", "seconds");
+  QCommandLineOption qps_option("qps", "Override the target rate, 0 for none.", "qps");
+  QCommandLineOption database_option("database", "Override the database file.", "file");
+  QCommandLineOption literals_option(
+      "inline-literals", "Inline values as sql literals instead of binding.");
+  QCommandLineOption csv_option("csv", "Print one csv row per shape.");
+  parser.addOptions({threads_option, duration_option, qps_option,
+                     database_option, literals_option, csv_option});
+  parser.process(app);
+
+  if (parser.positionalArguments().size() != 1) {
+    parser.showHelp(2);
+  }
+
+  Workload w = load(parser.positionalArguments()[0]);
+  if (parser.isSet(threads_option)) {
+    w.threads = parser.value(threads_option).toInt();
+  }
+  if (parser.isSet(duration_option)) {
+    w.duration = parser.value(duration_option).toDouble();
+  }
+  if (parser.isSet(qps_option)) {
+    w.qps = parser.value(qps_option).toDouble();
+  }
+  if (parser.isSet(database_option)) {
+    w.database = parser.value(database_option);
+  }
+  if (parser.isSet(literals_option)) {
+    w.inline_literals = true;
+  }
+  if (w.threads < 1 || w.duration <= 0) {
+    fail("threads and duration must be positive");
+  }
+
+  {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "replay-setup");
+    db.setDatabaseName(w.database);
+    if (!db.open()) {
+      fail(db.lastError().text().toStdString());
+    }
+    QSqlQuery query(db);
+    for (auto const& it : w.setup) {
+      if (!query.exec(it.c_str())) {
+        fail(it + ": " + query.lastError().text().toStdString());
+      }
+    }
+  }
+  QSqlDatabase::removeDatabase("replay-setup");
+
+  std::vector<ThreadResult> results(w.threads);
+  std::vector<std::thread> threads;
+  auto start = Clock::now();
+  for (int i = 0; i < w.threads; ++i) {
+    threads.emplace_back(replay, std::cref(w), i, start, std::ref(results[i]));
+  }
+  for (auto& it : threads) {
+    it.join();
+  }
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  for (auto const& it : results) {
+    if (!it.error.empty()) {
+      fail(it.error);
+    }
+  }
+
+  bool csv = parser.isSet(csv_option);
+  long total = 0;
+  long errors = 0;
+  if (csv) {
+    std::printf("shape,ops,errors,busy_retries,p50_ms,p99_ms,p999_ms\n");
+  } else {
+    std::printf("%-24s %9s %7s %7s %9s %9s %9s\n", "shape", "ops", "errors",
+                "busy", "p50 ms", "p99 ms", "p999 ms");
+  }
+
+  for (size_t i = 0; i < w.shapes.size(); ++i) {
+    ShapeResult shape;
+    for (auto const& it : results) {
+      auto const& r = it.shapes[i];
+      shape.latencies_ms.insert(shape.latencies_ms.end(),
+                                r.latencies_ms.begin(), r.latencies_ms.end());
+      shape.errors += r.errors;
+      shape.busy_retries += r.busy_retries;
+      if (shape.first_error.empty()) {
+        shape.first_error = r.first_error;
+      }
+    }
+    std::sort(shape.latencies_ms.begin(), shape.latencies_ms.end());
+    total += shape.latencies_ms.size();
+    errors += shape.errors;
+
+    const char* format = csv ? "%s,%zu,%ld,%ld,%.3f,%.3f,%.3f\n"
+                             : "%-24s %9zu %7ld %7ld %9.3f %9.3f %9.3f\n";
+    std::printf(format, w.shapes[i].name.c_str(), shape.latencies_ms.size(),
+                shape.errors, shape.busy_retries,
+                percentile(shape.latencies_ms, 0.5),
+                percentile(shape.latencies_ms, 0.99),
+                percentile(shape.latencies_ms, 0.999));
+    if (!shape.first_error.empty()) {
+      std::cerr << w.shapes[i].name << ": " << shape.first_error << std::endl;
+    }
+  }
+
+  if (!csv) {
+    std::printf("\n%ld ops in %.2fs on %d threads, %.1f ops/s", total,
+                elapsed.count(), w.threads, total / elapsed.count());
+    if (w.qps > 0) {
+      std::printf(" (target %.1f)", w.qps);
+    }
+    if (w.inline_literals) {
+      std::printf(", literals inlined");
+    }
+    std::printf("\n");
+  }
+
+  return errors ? 1 : 0;
+}
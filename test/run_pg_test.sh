@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# Start a throwaway postgres instance listening on a unix socket only, run
+# the given test binary against it and tear the instance down again.
+#
+# usage: run_pg_test.sh <postgres bin dir> <test binary>
+#
+set -e
+
+PG_BIN=$1
+TEST=$2
+DIR=$(mktemp -d)
+
+trap '"$PG_BIN/pg_ctl" -D "$DIR/data" -m immediate stop >/dev/null 2>&1; rm -rf "$DIR"' EXIT
+
+"$PG_BIN/initdb" -D "$DIR/data" -A trust -U postgres >/dev/null
+"$PG_BIN/pg_ctl" -D "$DIR/data" -l "$DIR/log" -w \
+    -o "-k $DIR -c listen_addresses=''" start >/dev/null
+
+"$TEST" "host=$DIR user=postgres dbname=postgres"
@@ -0,0 +1,576 @@
+#include <QCoreApplication>
+#include <QFile>
+#include <QSqlDatabase>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+#include "sql.h"
+#include "sql_advisor.h"
+#include "sql_blob.h"
+#ifdef HAVE_SQLITE3
+#include "sql_blob_stream.h"
+#endif
+#include "sql_registry.h"
+#include "sql_shard.h"
+#include "sql_stats.h"
+
+using namespace sql_builder;
+
+static void exec(QSqlDatabase& db, const char* sql) {
+  QSqlQuery query(db);
+  bool ok = query.exec(sql);
+  assert(ok);
+  (void) ok;
+}
+
+static void test_plan_capture(QSqlDatabase& db) {
+  exec(db, "create table user (id integer primary key, age int, name text)");
+  exec(db, "create index user_age on user(age)");
+
+  std::vector<ShapeStats> warnings;
+  QueryStats stats;
+  stats.capture_plans(true).on_plan_warning(
+      [&warnings](const ShapeStats& shape) { warnings.push_back(shape); });
+  add_observer(&stats);
+
+  QSqlQuery query(db);
+  for (int n = 0; n < 3; ++n) {
+    InsertModel i;
+    i.insert("id", n)("age", 20 + n)("name", "six").into("user");
+    assert(i.exec(query));
+  }
+
+  SelectModel by_age;
+  by_age.select("id").from("user").where(Column("age") == 21);
+  assert(by_age.exec(query));
+  assert(by_age.exec(query));
+
+  SelectModel by_name;
+  by_name.select("id").from("user").where(Column("name") == "six").order_by("name");
+  assert(by_name.exec(query));
+
+  // inlined literals share the shape they would have with placeholders
+  for (int n = 20; n < 23; ++n) {
+    SelectModel inlined;
+    inlined.select("id").from("user").where(Column("age").inline_literals(true) == n);
+    assert(inlined.exec(query));
+  }
+
+  // a shape is explained once it first succeeds; abs() of the smallest
+  // integer fails while the statement runs
+  for (int id = 0; id < 2; ++id) {
+    SelectModel overflow;
+    overflow.select("abs(id - 9223372036854775807 - 1)").from("user").where(Column("id") == id);
+    assert(overflow.exec(query) == (id == 1));
+  }
+
+  remove_observer(&stats);
+
+  ShapeStats insert;
+  assert(stats.find("insert into user(id, age, name) values(?, ?, ?)", insert));
+  assert(insert.executions == 3);
+
+  ShapeStats indexed;
+  assert(stats.find(by_age.str(), indexed));
+  assert(indexed.executions == 5);
+  assert(stats.find("select id from user where age = 99", indexed));
+  assert(!indexed.plan.empty());
+  assert(!indexed.full_scan && !indexed.temp_sort);
+
+  ShapeStats overflowed;
+  assert(stats.find("select abs(id - ? - ?) from user where id = ?", overflowed));
+  assert(overflowed.executions == 2 && overflowed.failures == 1);
+  assert(!overflowed.plan.empty() && !overflowed.full_scan);
+
+  ShapeStats scanned;
+  assert(stats.find(by_name.str(), scanned));
+  assert(scanned.full_scan && scanned.temp_sort);
+
+  assert(warnings.size() == 1);
+  assert(warnings[0].sql == by_name.str());
+}
+
+// runs a model from its callback and removes itself, the first time
+struct ReentrantObserver : QueryObserver {
+  explicit ReentrantObserver(QSqlDatabase& db) : db(db) {}
+
+  void executed(SqlModel&, QSqlQuery&, bool, double) override {
+    if (++calls == 1) {
+      remove_observer(this);
+      QSqlQuery query(db);
+      SelectModel s;
+      s.select("count(*)").from("user");
+      assert(s.exec(query));
+    }
+  }
+
+  QSqlDatabase& db;
+  int calls = 0;
+};
+
+static void test_reentrant_observer(QSqlDatabase& db) {
+  ReentrantObserver observer(db);
+  add_observer(&observer);
+
+  QSqlQuery query(db);
+  SelectModel s;
+  s.select("id").from("user");
+  assert(s.exec(query));
+  assert(s.exec(query));
+  assert(observer.calls == 1);
+}
+
+static void test_sharding() {
+  QTemporaryDir dir;
+  assert(dir.isValid());
+
+  QStringList files;
+  for (int n = 0; n < 3; ++n) {
+    QString file = dir.filePath(QString("shard-%1.db").arg(n));
+    {
+      QSqlDatabase shard = QSqlDatabase::addDatabase("QSQLITE", "setup");
+      shard.setDatabaseName(file);
+      assert(shard.open());
+      exec(shard, "create table user (id integer primary key, age int, name text)");
+      shard.close();
+    }
+    QSqlDatabase::removeDatabase("setup");
+    files << file;
+  }
+
+  // built before the executor, as a model declared at startup would be
+  SelectModel early;
+  early.select("id").from("user").where(Column("id") == 5);
+
+  ShardedExecutor shards("id", files, [](const QVariant& key) {
+    return static_cast<size_t>(key.toLongLong() % 3);
+  });
+  ShardedResult result;
+  assert(shards.route(early) == 2);
+
+  for (int n = 0; n < 30; ++n) {
+    InsertModel i;
+    i.insert("id", n)("age", n % 7)("name", "six").into("user");
+    assert(shards.route(i) == n % 3);
+    assert(shards.exec(i, result));
+    assert(result.affected == 1);
+  }
+
+  InsertModel keyless;
+  keyless.insert("age", 1).into("user");
+  assert(!shards.exec(keyless, result));
+
+  // pinned to one shard, also through a qualified name under an `and`
+  SelectModel one;
+  one.select("id", "age").from("user").where(Column("user.id") == 4 and Column("age") > 0);
+  assert(shards.route(one) == 1);
+  assert(shards.exec(one, result));
+  assert(result.rows.size() == 1);
+  assert(result.rows[0].at(0).toInt() == 4);
+
+  SelectModel either;
+  either.select("id").from("user").where(Column("id") == 4 or Column("id") == 5);
+  assert(shards.route(either) == ShardedExecutor::UNPINNED);
+
+  // only the first table's own columns pin a query
+  SelectModel joined;
+  joined.select("user.id")
+      .from("user")
+      .join("score")
+      .on("score.user_id = user.id")
+      .where(Column("score.id") == 4);
+  assert(shards.route(joined) == ShardedExecutor::UNPINNED);
+  SelectModel aliased;
+  aliased.select("u.id").from("user u").where(Column("u.id") == 4);
+  assert(shards.route(aliased) == 1);
+
+  // scattered and merged by order, offset and limit
+  SelectModel page;
+  page.select("id", "age").from("user").order_by("age desc, id").limit(5).offset(2);
+  assert(shards.exec(page, result));
+
+  std::vector<int> expected;
+  for (int n = 0; n < 30; ++n) {
+    expected.push_back(n);
+  }
+  std::sort(expected.begin(), expected.end(), [](int a, int b) {
+    return a % 7 != b % 7 ? a % 7 > b % 7 : a < b;
+  });
+  assert(result.rows.size() == 5);
+  for (int n = 0; n < 5; ++n) {
+    assert(result.rows[n].at(0).toInt() == expected[n + 2]);
+  }
+  assert(page.str() == "select id, age from user order by age desc, id limit 5 offset 2");
+
+  // a negative limit is none, and the offset is applied once, after merging
+  SelectModel rest;
+  rest.select("id").from("user").order_by("age desc, id").limit(-1).offset(25);
+  assert(shards.exec(rest, result));
+  assert(result.rows.size() == 5);
+  for (int n = 0; n < 5; ++n) {
+    assert(result.rows[n].at(0).toInt() == expected[n + 25]);
+  }
+
+  SelectModel totals;
+  totals.select("count(*)", "sum(age)", "min(id)", "max(id)").from("user").where(Column("age") < 6);
+  assert(shards.exec(totals, result));
+  assert(result.rows.size() == 1);
+  int count = 0, sum = 0;
+  for (int n = 0; n < 30; ++n) {
+    if (n % 7 < 6) {
+      ++count;
+      sum += n % 7;
+    }
+  }
+  assert(result.rows[0].at(0).toInt() == count);
+  assert(result.rows[0].at(1).toInt() == sum);
+  assert(result.rows[0].at(2).toInt() == 0);
+  assert(result.rows[0].at(3).toInt() == 29);
+
+  SelectModel grouped;
+  grouped.select("age", "count(*)").from("user").group_by("age");
+  assert(!shards.exec(grouped, result));
+
+  // aggregates that cannot be folded are refused, and scalar min and max are
+  // not folded
+  SelectModel names;
+  names.select("group_concat(name)").from("user");
+  assert(!shards.exec(names, result));
+  SelectModel spread;
+  spread.select("max(age) - min(age)").from("user");
+  assert(!shards.exec(spread, result));
+  SelectModel capped;
+  capped.select("min(age, 3)").from("user");
+  assert(shards.exec(capped, result) && result.rows.size() == 30);
+
+  // writes without the key go everywhere
+  UpdateModel u;
+  u.update("user").set("name", "ddc").where(Column("age") == 0);
+  assert(shards.route(u) == ShardedExecutor::UNPINNED);
+  assert(shards.exec(u, result));
+  assert(result.affected == 5);
+
+  DeleteModel d;
+  d._delete().from("user").where(Column("id").in(std::vector<int>{7}));
+  assert(shards.route(d) == 1);
+  assert(shards.exec(d, result));
+  assert(result.affected == 1);
+
+  // moving a row between shards is refused
+  UpdateModel rekey;
+  rekey.update("user").set("id", 100).where(Column("id") == 4);
+  assert(!shards.exec(rekey, result));
+  assert(result.error == "update of the shard key");
+
+  // as is a router answer that is not a shard, rather than going everywhere
+  ShardedExecutor broken("id", files, [](const QVariant&) {
+    return static_cast<size_t>(-1);
+  });
+  DeleteModel lost;
+  lost._delete().from("user").where(Column("id") == 4);
+  assert(broken.route(lost) == ShardedExecutor::OUT_OF_RANGE);
+  assert(!broken.exec(lost, result));
+  assert(shards.exec(one, result) && result.rows.size() == 1);
+}
+
+static void test_warm_up() {
+  QTemporaryDir dir;
+  assert(dir.isValid());
+  QString file = dir.filePath("warm.db");
+  {
+    QSqlDatabase setup = QSqlDatabase::addDatabase("QSQLITE", "setup");
+    setup.setDatabaseName(file);
+    assert(setup.open());
+    exec(setup, "create table user (id integer primary key, age int, name text)");
+    setup.close();
+  }
+  QSqlDatabase::removeDatabase("setup");
+
+  StatementRegistry registry;
+
+  SelectModel by_id;
+  by_id.select("id", "name").from("user").where(Column("id") == 0);
+  InsertModel add;
+  add.insert("id", 0)("age", 0)("name", "").into("user");
+  SelectModel broken;
+  broken.select("id").from("missing");
+  assert(registry.add("user.by_id", by_id));
+  assert(registry.add("user.add", add));
+  assert(registry.add("missing", broken));
+  // names are unique
+  assert(!registry.add("user.add", by_id));
+  assert(registry.size() == 3);
+
+  std::vector<WarmupReport> reports;
+  registry.run_selects(true).on_warm_up(
+      [&reports](const WarmupReport& report) { reports.push_back(report); });
+
+  {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "pooled");
+    db.setDatabaseName(file);
+    assert(registry.open(db));
+
+    // the insert was prepared, never run
+    QSqlQuery query(db);
+    assert(query.exec("select count(*) from user") && query.next());
+    assert(query.value(0).toInt() == 0);
+
+    // the statements prepared at warm up are handed out and reused
+    QSqlQuery prepared_add = registry.query(db, "user.add");
+    assert(prepared_add.result() == registry.query(db, "user.add").result());
+    for (int n = 1; n <= 3; ++n) {
+      InsertModel i;
+      i.insert("id", n)("age", 20 + n)("name", "six").into("user");
+      assert(i.exec_prepared(prepared_add));
+    }
+
+    QSqlQuery prepared_by_id = registry.query(db, "user.by_id");
+    SelectModel s;
+    s.select("id", "name").from("user").where(Column("id") == 2);
+    assert(s.exec_prepared(prepared_by_id) && prepared_by_id.next());
+    assert(prepared_by_id.value(0).toInt() == 2);
+    assert(!prepared_by_id.next());
+
+    // a model of another shape does not bind into this statement
+    prepared_by_id.finish();
+    SelectModel by_name;
+    by_name.select("id").from("user").where(Column("name") == "six");
+    assert(by_name.exec_prepared(prepared_by_id));
+    int rows = 0;
+    while (prepared_by_id.next()) {
+      ++rows;
+    }
+    assert(rows == 3);
+    assert(prepared_by_id.lastQuery().toStdString() == by_name.last_sql());
+
+    QSqlQuery unknown = registry.query(db, "user.unknown");
+    assert(unknown.lastQuery().isEmpty());
+
+    registry.release(db);
+  }
+  QSqlDatabase::removeDatabase("pooled");
+
+  assert(reports.size() == 1);
+  assert(reports[0].connection == "pooled");
+  assert(reports[0].prepared == 2);
+  assert(reports[0].executed == 1);
+  assert(reports[0].failures.size() == 1);
+  assert(reports[0].failures[0].first == "missing");
+  assert(reports[0].elapsed_ms >= 0);
+}
+
+static bool suggested(const std::vector<IndexSuggestion>& suggestions,
+                      const std::string& sql) {
+  for (auto const& it : suggestions) {
+    if (it.sql() == sql) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void test_index_advisor(QSqlDatabase& db) {
+  exec(db, "create table score (id integer primary key, user_id int, value int)");
+  exec(db, "create index score_user on score(user_id)");
+
+  // built before the advisor, as a model declared at startup would be
+  SelectModel by_age;
+  by_age.select("id").from("user").where(Column("age") == 1);
+
+  IndexAdvisor advisor;
+  add_observer(&advisor);
+
+  QSqlQuery query(db);
+  for (int n = 0; n < 5; ++n) {
+    SelectModel s;
+    s.select("id").from("user").where(Column("age") == n and Column("name") > "a");
+    assert(s.exec(query));
+  }
+  assert(by_age.exec(query));
+
+  SelectModel joined;
+  joined.select("user.id", "value")
+      .from("user")
+      .join("score s")
+      .on(Column("user.id") == Column("s.user_id"))
+      .where(Column("s.value") > 10);
+  assert(joined.exec(query));
+
+  SelectModel sorted;
+  sorted.select("id", "name").from("user").order_by("name desc");
+  assert(sorted.exec(query));
+
+  remove_observer(&advisor);
+
+  bool found = false;
+  for (auto const& it : advisor.usage()) {
+    if (it.table == "user" && it.column == "age") {
+      assert(it.equality == 6);
+      found = true;
+    }
+  }
+  assert(found);
+
+  auto suggestions = advisor.suggest(db);
+  assert(suggestions.size() == 3);
+  assert(suggested(suggestions, "create index idx_user_age_name on user(age, name)"));
+  assert(suggested(suggestions, "create index idx_score_user_id_value on score(user_id, value)"));
+  assert(suggested(suggestions, "create index idx_user_name on user(name)"));
+  // the prefix shape is served by the wider index and counted with it
+  for (auto const& it : suggestions) {
+    if (it.columns.size() == 2 && it.table == "user") {
+      assert(it.executions == 6);
+    }
+  }
+
+  exec(db, "create index user_age_name on user(age, name)");
+  suggestions = advisor.suggest(db);
+  assert(suggestions.size() == 2);
+  assert(!suggested(suggestions, "create index idx_user_age_name on user(age, name)"));
+}
+
+static std::vector<char> blob_payload() {
+  std::vector<char> payload(3 * 1024 * 1024 + 7);
+  for (size_t i = 0; i < payload.size(); ++i) {
+    payload[i] = static_cast<char>(i * 31);
+  }
+  return payload;
+}
+
+static void test_blobs(QSqlDatabase& db) {
+  exec(db, "create table file (id integer primary key, data blob)");
+  std::vector<char> payload = blob_payload();
+
+  QSqlQuery query(db);
+  InsertModel i;
+  i.insert("id", 1)("data", BlobRef{payload.data(), payload.size()}).into("file");
+  assert(i.exec(query));
+  assert(query.exec("select length(data) from file where id = 1") && query.next());
+  assert(query.value(0).toInt() == static_cast<int>(payload.size()));
+
+  // too large for a QByteArray: the statement fails rather than storing a
+  // null or a truncated value
+  BlobRef huge{payload.data(), static_cast<size_t>(INT_MAX) + 1};
+  InsertModel too_large;
+  too_large.insert("id", 5)("data", huge).into("file");
+  assert(too_large.str() == "insert into file(id, data) values(?, blob_too_large())");
+  assert(too_large.bindings().size() == 1);
+  assert(!too_large.exec(query));
+  UpdateModel set_too_large;
+  set_too_large.update("file").set("data", huge).where(Column("id") == 1);
+  assert(set_too_large.str() == "update file set data = blob_too_large() where id = ?");
+  assert(!set_too_large.exec(query));
+  assert(query.exec("select count(*) from file where data is null") && query.next());
+  assert(query.value(0).toInt() == 0);
+
+  InsertModel reserve;
+  reserve.insert("id", 2)("data", ZeroBlob{1024 * 1024}).into("file");
+  assert(reserve.str() == "insert into file(id, data) values(?, zeroblob(?))");
+  assert(reserve.exec(query));
+
+  // a mapped file binds like any other blob; an empty one is not null
+  QTemporaryDir dir;
+  assert(dir.isValid());
+  QFile file(dir.filePath("payload"));
+  assert(file.open(QIODevice::WriteOnly));
+  file.write(payload.data(), 4096);
+  file.close();
+  QFile empty(dir.filePath("empty"));
+  assert(empty.open(QIODevice::WriteOnly));
+  empty.close();
+  {
+    MappedBlob mapped(file.fileName());
+    MappedBlob mapped_empty(empty.fileName());
+    assert(mapped.is_open() && mapped_empty.is_open());
+    InsertModel a, b;
+    a.insert("id", 3)("data", mapped.blob()).into("file");
+    b.insert("id", 4)("data", mapped_empty.blob()).into("file");
+    assert(a.exec(query) && b.exec(query));
+  }
+  assert(query.exec("select length(data), data is null from file "
+                    "where id in (3, 4) order by id"));
+  assert(query.next() && query.value(0).toInt() == 4096);
+  assert(query.next() && query.value(0).toInt() == 0 && !query.value(1).toBool());
+
+  UpdateModel clear;
+  clear.update("file").set("data", ZeroBlob{8}).where(Column("id") == 3);
+  assert(clear.str() == "update file set data = zeroblob(?) where id = ?");
+  assert(clear.exec(query));
+}
+
+#ifdef HAVE_SQLITE3
+// runs after test_blobs, on the rows it inserted
+static void test_blob_stream(QSqlDatabase& db) {
+  std::vector<char> payload = blob_payload();
+
+  // read back in chunks
+  BlobStream in(db, "file", "data", 1);
+  assert(in.is_open());
+  assert(in.size() == static_cast<int>(payload.size()));
+  size_t offset = 0;
+  bool same = true;
+  assert(in.read_chunks(64 * 1024, [&](const char* data, int size) {
+    same = same && std::memcmp(data, &payload[offset], size) == 0;
+    offset += size;
+  }));
+  assert(same && offset == payload.size());
+  assert(!in.read_chunks(0, [](const char*, int) { assert(false); }));
+  assert(!in.error().empty());
+  in.close();
+
+  // fill the zero blob in place
+  BlobStream out(db, "file", "data", 2, true);
+  assert(out.is_open() && out.size() == 1024 * 1024);
+  for (int at = 0; at < out.size(); at += 64 * 1024) {
+    assert(out.write(&payload[at], 64 * 1024, at));
+  }
+  // writes cannot grow the value
+  assert(!out.write(payload.data(), 1, 1024 * 1024));
+  assert(!out.error().empty());
+
+  // the same stream moves across rows
+  std::vector<char> head(16);
+  assert(out.reopen(1) && out.read(head.data(), 16, 0));
+  assert(std::memcmp(head.data(), payload.data(), 16) == 0);
+  out.close();
+
+  QSqlQuery query(db);
+  assert(query.exec("select length(data), substr(data, 65537, 4) = "
+                    "substr((select data from file where id = 1), 65537, 4) "
+                    "from file where id = 2") &&
+         query.next());
+  assert(query.value(0).toInt() == 1024 * 1024);
+  assert(query.value(1).toBool());
+
+  BlobStream missing(db, "file", "data", 99);
+  assert(!missing.is_open() && !missing.error().empty());
+}
+#endif
+
+int main(int argc, char** argv) {
+  QCoreApplication app(argc, argv);
+
+  QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE");
+  db.setDatabaseName(":memory:");
+  if (!db.open()) {
+    std::cerr << db.lastError().text().toStdString() << std::endl;
+    return 1;
+  }
+
+  test_plan_capture(db);
+  test_reentrant_observer(db);
+  test_index_advisor(db);
+  test_sharding();
+  test_warm_up();
+  test_blobs(db);
+#ifdef HAVE_SQLITE3
+  test_blob_stream(db);
+#endif
+
+  std::cout << "sqlite ok" << std::endl;
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <cassert>
 #include <iostream>
+#include <random>
 #include <sstream>
 
 #include "sql.h"
@@ -20,6 +21,26 @@ create table if not exists user (
 
 using namespace sql_builder;
 
+// decode the single quoted literal at the start of sql, returning how many
+// characters it spans or 0 if it is not a well formed literal
+static size_t parse_literal(const std::string& sql, std::string& value) {
+  if (sql.empty() || sql[0] != '\'') {
+    return 0;
+  }
+  value.clear();
+  for (size_t i = 1; i < sql.size(); ++i) {
+    if (sql[i] != '\'') {
+      value.push_back(sql[i]);
+    } else if (i + 1 < sql.size() && sql[i + 1] == '\'') {
+      value.push_back('\'');
+      ++i;
+    } else {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
 int main() {
   InsertModel i;
   i.insert("score", 100)
@@ -51,6 +72,68 @@ int main() {
   assert(s.str()
              == "select distinct id, age, name, address from user join score on (user.id = score.id) and (score.id > ?) where (score > ?) and ((age >= ?) or (address is not null)) group by age having age > ? order by age desc limit 10 offset 1");
 
+  auto terms = order_by_terms("age desc, user.name,id ASC");
+  assert(terms.size() == 3);
+  assert(terms[0].first == "age" && terms[0].second);
+  assert(terms[1].first == "user.name" && !terms[1].second);
+  assert(terms[2].first == "id" && !terms[2].second);
+
+  SelectModel total = s.count();
+
+  std::cout << total.str() << std::endl;
+
+  assert(total.str()
+             == "select count(*) from (select distinct id, age, name, address from user join score on (user.id = score.id) and (score.id > ?) where (score > ?) and ((age >= ?) or (address is not null)) group by age having age > ?) as counted");
+  assert(total.bindings().size() == 4);
+
+  assert(s.exists().str()
+             == "select id, age, name, address from user join score on (user.id = score.id) and (score.id > ?) where (score > ?) and ((age >= ?) or (address is not null)) group by age having age > ? limit 1");
+
+  SelectModel paged;
+  paged.select("id", "name").from("user").where(Column("age") > 20).order_by("id").limit(10).offset(20);
+  assert(paged.count().str() == "select count(*) from user where age > ?");
+  assert(paged.count().bindings().size() == 1);
+  assert(paged.exists().str() == "select 1 from user where age > ? limit 1");
+
+  // an aggregate without a group by returns one row whatever matches
+  SelectModel oldest;
+  oldest.select("max(age)").from("user").where(Column("id") == 7);
+  assert(oldest.count().str() == "select count(*) from (select max(age) from user where id = ?) as counted");
+  assert(oldest.exists().str() == "select 1 from (select max(age) from user where id = ?) as counted limit 1");
+  assert(oldest.exists().bindings().size() == 1);
+
+  assert(literal_shape("select id from user where age = -5 and name = 'it''s' and x > 1.5e-07 and y in (1, -2)")
+         == "select id from user where age = ? and name = ? and x > ? and y in (?, ?)");
+  assert(literal_shape("select \"a1\", b2 from t where c = 'x' limit 10") == "select \"a1\", b2 from t where c = ? limit ?");
+
+  // the scalar min and max are not aggregates
+  SelectModel lesser;
+  lesser.select("min(age, 18)").from("user");
+  assert(lesser.count().str() == "select count(*) from user");
+  AggregateCall call;
+  assert(aggregate_call("Count( DISTINCT id ) as n", call));
+  assert(call.function == "count" && call.distinct && call.whole);
+  assert(aggregate_call("string_agg(name, ',')", call) && call.function == "string_agg");
+  assert(aggregate_call("max(age) - min(age)", call) && !call.whole);
+  assert(aggregate_call("max(')', age)", call) == false);
+  assert(!is_aggregate("max(age, 18)") && !is_aggregate("counter") && !is_aggregate("age"));
+
+  QVariant id;
+  Column tracked("id");
+  tracked == 7;
+  assert(tracked.equalities().size() == 1 && tracked.uses().size() == 1);
+
+  // neither equalities nor column uses survive an `or`
+  Column a_or_b = Column("a") == 1 or Column("b") == 2;
+  assert(a_or_b.equalities().empty() && a_or_b.uses().empty());
+  Column c_and = Column("c") > 3 and (Column("a") == 1 or Column("b") == 2);
+  assert(c_and.uses().size() == 1 && c_and.uses()[0].first == Identifier("c"));
+
+  // derived tables keep the equalities of the rows they count
+  SelectModel ages;
+  ages.select("age").distinct().from("user").where(Column("user.id") == 7);
+  assert(ages.count().equality("id", id));
+
   std::vector<int> a = {1, 2, 3};
   UpdateModel u;
   u.update("user")
@@ -68,5 +151,115 @@ int main() {
 
   assert(d.str() == "delete from user where id = ?");
 
+  // identifiers are interned: one id and one copy of the text per name
+  Identifier user("user");
+  assert(user == Identifier(std::string("user")));
+  assert(user != Identifier("score"));
+  assert(&user.str() == &Identifier("user").str());
+  assert(Identifier().empty() && Identifier("").empty());
+  // expressions keep their own text instead of growing the table
+  Identifier count("count(*)");
+  assert(!count.interned() && count.id() == Identifier::EXPRESSION);
+  assert(count == Identifier(std::string("count(*)")));
+  assert(count != Identifier("count(id)") && count != Identifier("count"));
+  assert(&count.str() != &Identifier("count(*)").str());
+  assert(user.interned() && Identifier("user.*").interned());
+  // a moved expression keeps its text
+  Identifier moved(std::move(count));
+  assert(moved == Identifier("count(*)"));
+  // conditions name their column by handle until rendered
+  Column by_user("user.id");
+  by_user == 1;
+  assert(&by_user.condition().name.str() == &Identifier("user.id").str());
+  assert(by_user.condition().text == " = ?");
+  assert(by_user.str() == "user.id = ?");
+
+  // raw sql conditions
+  SelectModel raw;
+  raw.select("id")
+      .from("user")
+      .join("score")
+      .on("score.id = user.id")
+      .where("age > 1")
+      .group_by("id")
+      .having("count(*) > 1");
+  assert(raw.str() == "select id from user join score on score.id = user.id where age > 1 group by id having count(*) > 1");
+  UpdateModel raw_update;
+  raw_update.update("user").set("age", 1).where("age > 1");
+  assert(raw_update.str() == "update user set age = ? where age > 1");
+  DeleteModel raw_delete;
+  raw_delete._delete().from("user").where("age > 1");
+  assert(raw_delete.str() == "delete from user where age > 1");
+
+  InsertModel il;
+  il.inline_literals(true)
+      .insert("score", 100)
+          ("name", std::string("it's"))
+          ("age", (unsigned char) 20)
+          ("ratio", 0.5)
+          ("address", "back\\slash")
+          ("active", true)
+          ("create_time", nullptr)
+      .into("user");
+
+  std::cout << il.str() << std::endl;
+
+  assert(il.str() == "insert into user(score, name, age, ratio, address, active, create_time) values(100, 'it''s', 20, 0.5, ?, ?, null)");
+  assert(il.bindings().size() == 2);
+
+  UpdateModel ul;
+  ul.inline_literals(true)
+      .update("user")
+      .set("name", "ddc")("age", -18)("score", 2.0)
+      .where(Column("id").inline_literals(true).in(a));
+
+  std::cout << ul.str() << std::endl;
+
+  assert(ul.str() == "update user set name = 'ddc', age = -18, score = 2.0 where id in (1, 2, 3)");
+  assert(ul.bindings().empty());
+
+  // variants inline by the type they hold
+  Column v("age");
+  v.inline_literals(true) == QVariant(42LL);
+  assert(v.str() == "age = 42" && v.bindings().empty());
+  Column r("ratio");
+  r.inline_literals(true) == QVariant(0.25);
+  assert(r.str() == "ratio = 0.25");
+  Column n("name");
+  n.inline_literals(true) == QVariant(QString("o'k"));
+  assert(n.str() == "name = 'o''k'");
+  Column b("active");
+  b.inline_literals(true) == QVariant(true);
+  assert(b.str() == "active = ?" && b.bindings().size() == 1);
+
+  // whatever the input, an inlined string is exactly one well formed literal
+  // that decodes back to the input, or the value is bound
+  std::mt19937 rng(20261019);
+  const char alphabet[] = "'\"\\;-/*% _a\0\x80\xbf\xef";
+  std::uniform_int_distribution<size_t> length(0, 24);
+  std::uniform_int_distribution<size_t> pick(0, sizeof(alphabet) - 2);
+  for (int n = 0; n < 100000; ++n) {
+    std::string value;
+    for (size_t l = length(rng); l > 0; --l) {
+      value.push_back(alphabet[pick(rng)]);
+    }
+
+    Column c("name");
+    c.inline_literals(true) == value;
+    const std::string prefix = "name = ";
+    assert(c.str().compare(0, prefix.size(), prefix) == 0);
+    std::string rest = c.str().substr(prefix.size());
+
+    if (c.bindings().empty()) {
+      std::string decoded;
+      assert(parse_literal(rest, decoded) == rest.size());
+      assert(decoded == value);
+      assert(value.find('\\') == std::string::npos);
+      assert(value.find('\0') == std::string::npos);
+    } else {
+      assert(rest == "?");
+    }
+  }
+
   return 0;
 }